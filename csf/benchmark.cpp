@@ -17,48 +17,20 @@ extern "C" {
 
 #include <iostream>
 #include <vector>
-#include <fstream>
 #include <string>
 #include <chrono>
 #include <fcntl.h>
 #include <unistd.h>
 #include <random>
+#include <sys/mman.h>
 
-std::vector<std::string> read_file(const std::string& filename) {
-    std::ifstream file(filename);
-    std::vector<std::string> lines;
-    std::string line;
-    if (file.is_open()) {
-        while (std::getline(file, line))
-            lines.push_back(line);
-    } else {
-        std::cerr << "Failed to open file: " << filename << std::endl;
-        exit(1);
-    }
-    return lines;
-}
+#include "lsf/dataset_reader.hpp"
 
-std::vector<int64_t> read_int64_binary_big_endian(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
-    std::vector<int64_t> numbers;
-    if (file.is_open()) {
-        file.seekg(0, std::ios::end);
-        std::streampos fileSize = file.tellg();
-        file.seekg(0, std::ios::beg);
-        std::size_t numValues = fileSize / sizeof(uint64_t);
-        numbers.resize(numValues);
-        file.read(reinterpret_cast<char*>(numbers.data()), fileSize);
-        for (auto &x : numbers) {
-            x = __builtin_bswap64(x);
-        }
-    } else {
-        std::cerr << "Failed to open file: " << filename << std::endl;
-        exit(1);
-    }
-    return numbers;
+// the CSF functions take a mutable pointer but only read the key, which lives in the read-only mapping
+static char *key_data(std::string_view key) {
+    return const_cast<char *>(key.data());
 }
 
-
 int main(int argc, char* argv[]) {
     if (argc != 3) {
         std::cerr << "Usage: " << argv[0] << " <dataset_path> <csf_path>" << std::endl;
@@ -67,9 +39,8 @@ int main(int argc, char* argv[]) {
 
     std::string dataset_path = argv[1];
     std::string csf_path = argv[2];
-    auto inputs = read_file(dataset_path + "_X.sux4j");
-    auto outputs = read_int64_binary_big_endian(dataset_path + "_y.sux4j");
-    if (inputs.size() != outputs.size()) {
+    lsf::Sux4jDatasetReader dataset(dataset_path);
+    if (dataset.size() != dataset.values_count()) {
         std::cerr << "Input and output sizes do not match" << std::endl;
         exit(1);
     }
@@ -82,19 +53,22 @@ int main(int argc, char* argv[]) {
     csf *csf = load_csf(h);
 	close(h);
 
-    for (int i = 0; i < inputs.size(); i++) {
-        if (CSF_GET(csf, inputs[i].data(), inputs[i].size()) != outputs[i]) {
+    dataset.advise(MADV_SEQUENTIAL);
+    for (size_t i = 0; i < dataset.size(); i++) {
+        auto key = dataset.get_key(i);
+        if (CSF_GET(csf, key_data(key), key.size()) != dataset.get_value(i)) {
             std::cerr << "Mismatch at index: " << i << std::endl;
-            std::cerr << "Input: " << inputs[i] << std::endl;
-            std::cerr << "Expected: " << outputs[i] << std::endl;
-            std::cerr << "Got: " << CSF_GET(csf, inputs[i].data(), inputs[i].size()) << std::endl;
+            std::cerr << "Input: " << key << std::endl;
+            std::cerr << "Expected: " << dataset.get_value(i) << std::endl;
+            std::cerr << "Got: " << CSF_GET(csf, key_data(key), key.size()) << std::endl;
             exit(1);
         }
     }
+    dataset.advise(MADV_RANDOM);
 
     std::vector<uint32_t> queries(QUERIES);
     std::mt19937 gen(42);
-    std::uniform_int_distribution<uint32_t> dist(0, inputs.size() - 1);
+    std::uniform_int_distribution<uint32_t> dist(0, dataset.size() - 1);
     for (auto &query : queries) {
         query = dist(gen);
     }
@@ -103,7 +77,8 @@ int main(int argc, char* argv[]) {
     auto start_hash = std::chrono::high_resolution_clock::now();
     for (auto repeat = 0; repeat < REPEATS; ++repeat) {
         for (auto i: queries) {
-            spooky_short(inputs[i].data(), inputs[i].size(), csf->global_seed, signature);
+            auto key = dataset.get_key(i);
+            spooky_short(key.data(), key.size(), csf->global_seed, signature);
         }
     }
     auto end_hash = std::chrono::high_resolution_clock::now();
@@ -113,7 +88,8 @@ int main(int argc, char* argv[]) {
     auto start = std::chrono::high_resolution_clock::now();
     for (auto repeat = 0; repeat < REPEATS; ++repeat) {
         for (auto i: queries) {
-            sum += CSF_GET(csf, inputs[i].data(), inputs[i].size());
+            auto key = dataset.get_key(i);
+            sum += CSF_GET(csf, key_data(key), key.size());
         }
     }
     auto end = std::chrono::high_resolution_clock::now();
@@ -123,7 +99,7 @@ int main(int argc, char* argv[]) {
     std::cout << "Results sum: " << sum << std::endl;
     std::cout << "Time: " << duration / (queries.size() * REPEATS)  << " ns/query" << std::endl;
     std::cout << "Hash time: " << duration_hash / (queries.size() * REPEATS)  << " ns/query" << std::endl;
-    std::cout << "Size: " << inputs.size() << std::endl;
+    std::cout << "Size: " << dataset.size() << std::endl;
 
     return 0;
 }
\ No newline at end of file
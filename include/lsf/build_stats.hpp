@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lsf {
+
+    /** Number of codes per code length in bits. */
+    class LengthHistogram {
+        std::vector<uint64_t> counts;
+
+    public:
+        void add(size_t length) {
+            if (length >= counts.size())
+                counts.resize(length + 1);
+            counts[length]++;
+        }
+
+        void merge(const LengthHistogram &other) {
+            if (other.counts.size() > counts.size())
+                counts.resize(other.counts.size());
+            for (size_t l = 0; l < other.counts.size(); ++l)
+                counts[l] += other.counts[l];
+        }
+
+        /** count()[l] is the number of codes of length l. */
+        const std::vector<uint64_t> &count() const { return counts; }
+
+        size_t max() const {
+            for (size_t l = counts.size(); l > 0; --l)
+                if (counts[l - 1] > 0)
+                    return l - 1;
+            return 0;
+        }
+
+        uint64_t total_bits() const {
+            uint64_t bits = 0;
+            for (size_t l = 0; l < counts.size(); ++l)
+                bits += l * counts[l];
+            return bits;
+        }
+    };
+
+    /**
+     * Report of a storage build: the time of every phase, the temporary memory, the distribution of the code lengths
+     * and the resulting ribbon sizes. For a partitioned storage, it covers all shards, with the phase times summed up
+     * over the shards, i.e., CPU time rather than wall time.
+     */
+    struct BuildStats {
+        size_t keys = 0;
+        // model inference and filter coding of all keys
+        uint64_t encodeNanos = 0;
+        uint64_t filterRibbonNanos = 0;
+        // filter lookups and correction coding of all keys
+        uint64_t correctionEncodeNanos = 0;
+        uint64_t correctionRibbonNanos = 0;
+        // the largest amount of input rows, stashed coder decisions and estimated ribbon temporaries held at once
+        size_t peakTemporaryBytes = 0;
+        size_t spilledBytes = 0;
+        LengthHistogram filterLengths;
+        LengthHistogram correctionLengths;
+        // bits of the filter code that the filter ribbon stores, i.e., skipping the 1s
+        LengthHistogram filterBitsSet;
+        size_t filterRibbonBytes = 0;
+        size_t correctionRibbonBytes = 0;
+
+        /** Keys with an empty correction code, whose queries only access the filter ribbon. */
+        uint64_t correction_free_keys() const {
+            return correctionLengths.count().empty() ? 0 : correctionLengths.count()[0];
+        }
+
+        uint64_t total_nanos() const {
+            return encodeNanos + filterRibbonNanos + correctionEncodeNanos + correctionRibbonNanos;
+        }
+
+        /** Adds the report of another part of the same structure, e.g., a shard. */
+        void merge(const BuildStats &other) {
+            keys += other.keys;
+            encodeNanos += other.encodeNanos;
+            filterRibbonNanos += other.filterRibbonNanos;
+            correctionEncodeNanos += other.correctionEncodeNanos;
+            correctionRibbonNanos += other.correctionRibbonNanos;
+            peakTemporaryBytes = std::max(peakTemporaryBytes, other.peakTemporaryBytes);
+            spilledBytes += other.spilledBytes;
+            filterLengths.merge(other.filterLengths);
+            correctionLengths.merge(other.correctionLengths);
+            filterBitsSet.merge(other.filterBitsSet);
+            filterRibbonBytes += other.filterRibbonBytes;
+            correctionRibbonBytes += other.correctionRibbonBytes;
+        }
+
+        /** The scalar fields as key=value pairs, each name prefixed with build_, for the RESULT lines of benchmarks. */
+        std::vector<std::string> to_result_fields() const {
+            std::vector<std::string> fields;
+            for (const auto &[name, value]: scalars())
+                fields.push_back("build_" + name + "=" + value);
+            return fields;
+        }
+
+        /** All fields including the length histograms as a single-line JSON object. */
+        std::string to_json() const {
+            std::ostringstream json;
+            json << "{";
+            for (const auto &[name, value]: scalars())
+                json << "\"" << name << "\":" << value << ",";
+            auto histogram = [&](const char *name, const LengthHistogram &h) {
+                json << "\"" << name << "\":[";
+                for (size_t l = 0; l < h.count().size(); ++l)
+                    json << (l > 0 ? "," : "") << h.count()[l];
+                json << "]";
+            };
+            histogram("filter_length_histogram", filterLengths);
+            json << ",";
+            histogram("correction_length_histogram", correctionLengths);
+            json << ",";
+            histogram("filter_bits_set_histogram", filterBitsSet);
+            json << "}";
+            return json.str();
+        }
+
+        void print(std::ostream &os) const {
+            const double n = double(std::max<size_t>(1, keys));
+            const uint64_t preprocessing = encodeNanos + filterRibbonNanos + correctionEncodeNanos;
+            os << "Preprocessing time (including filter): " << preprocessing << " ns (" << (preprocessing / n)
+               << " ns/item)\n";
+            os << "Ribbon construction time: " << correctionRibbonNanos << " ns (" << (correctionRibbonNanos / n)
+               << " ns/item)\n";
+            os << "Total construction time: " << total_nanos() << " ns (" << (total_nanos() / n) << " ns/item)\n";
+            os << "Max length correction: " << correctionLengths.max() << "\n";
+            os << "Max length filter: " << filterLengths.max() << "\n";
+            os << "Ribbon size: " << (correctionRibbonBytes * 8) << " bits\n";
+            os << "Filter size: " << (filterRibbonBytes * 8) << " bits\n";
+            os << "Ribbon+Filter size: " << ((correctionRibbonBytes + filterRibbonBytes) * 8) << " bits\n";
+            os << "Ribbon bits/example: " << (correctionRibbonBytes * 8 / n) << "\n";
+            os << "Filter bits/example: " << (filterRibbonBytes * 8 / n) << "\n";
+            os << "Ribbon+Filter bits/example: " << ((correctionRibbonBytes + filterRibbonBytes) * 8 / n) << "\n";
+            os << "Huffman bits: " << correctionLengths.total_bits() << "\n";
+            os << "Peak temporary memory: " << peakTemporaryBytes << " bytes, spilled " << spilledBytes
+               << " bytes\n";
+        }
+
+    private:
+
+        std::vector<std::pair<std::string, std::string>> scalars() const {
+            return {
+                    {"keys", std::to_string(keys)},
+                    {"encode_nanos", std::to_string(encodeNanos)},
+                    {"filter_ribbon_nanos", std::to_string(filterRibbonNanos)},
+                    {"correction_encode_nanos", std::to_string(correctionEncodeNanos)},
+                    {"correction_ribbon_nanos", std::to_string(correctionRibbonNanos)},
+                    {"total_nanos", std::to_string(total_nanos())},
+                    {"peak_temporary_bytes", std::to_string(peakTemporaryBytes)},
+                    {"spilled_bytes", std::to_string(spilledBytes)},
+                    {"max_filter_length", std::to_string(filterLengths.max())},
+                    {"max_correction_length", std::to_string(correctionLengths.max())},
+                    {"filter_code_bits", std::to_string(filterLengths.total_bits())},
+                    {"correction_code_bits", std::to_string(correctionLengths.total_bits())},
+                    {"correction_free_keys", std::to_string(correction_free_keys())},
+                    {"filter_bits_set", std::to_string(filterBitsSet.total_bits())},
+                    {"filter_ribbon_bytes", std::to_string(filterRibbonBytes)},
+                    {"correction_ribbon_bytes", std::to_string(correctionRibbonBytes)},
+            };
+        }
+    };
+}
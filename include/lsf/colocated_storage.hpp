@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "build_stats.hpp"
+#include "filter_coding.hpp"
+#include "huge_pages.hpp"
+#include "parallel.hpp"
+#include "persistence.hpp"
+#include "query_profile.hpp"
+#include "retrieval_backend.hpp"
+
+namespace lsf {
+
+    /**
+     * Stores the filter code and the correction code of a key in the same row of a single retrieval, the filter
+     * code in the lowest filterBits bits and the correction code above. A query thus reads both codes from the
+     * cache lines of one ribbon lookup instead of from two unrelated tables, saving the DRAM miss of the correction
+     * lookup that FilteredLSFStorage pays for keys that need a correction bit. Queries decode to the same values.
+     *
+     * The filter code is padded to the longest one, and its 0s are stored too, so the correction codes follow
+     * from the filter codes directly, as for FixedWidthFilterBackend, without building and querying a filter ribbon
+     * first. That costs space: every key occupies filterBits bits for the filter instead of the 1s of its own code.
+     * The build report counts the single retrieval as the correction ribbon. There is no streaming build.
+     */
+    template<typename Coding, RetrievalBackend Backend = BuRRVLRBackend>
+    class CoLocatedLSFStorage {
+        using Row = typename Backend::Row;
+
+        Backend retrieval;
+        Coding coder;
+        size_t classes;
+        size_t filterBits = 0;
+        std::vector<float> coder_frequencies;
+        HugePageMode tablePages = HugePageMode::NONE;
+        size_t hugePageTableBytes = 0;
+
+        size_t statistic_bits_input;
+    public:
+
+        CoLocatedLSFStorage() {}
+
+        /** Places the retrieval table of later builds and loads on huge pages, see FilteredLSFStorage. */
+        void set_huge_pages(HugePageMode mode) {
+            require_huge_page_new(mode);
+            tablePages = mode;
+        }
+
+        size_t huge_page_bytes() const { return hugePageTableBytes; }
+
+        /** Builds keep nothing to spill, as the correction codes are derived in the encoding pass. */
+        void set_stash_budget(size_t) {}
+
+        /** Estimated peak memory of build(n): the encoded keys or the ribbon temporaries next to the input rows. */
+        static size_t build_bytes(size_t n) {
+            return n * (sizeof(Row) + std::max(sizeof(EncodedKey), Backend::BUILD_BYTES_PER_KEY));
+        }
+
+        static size_t stash_bytes(size_t) {
+            return 0;
+        }
+
+        template<typename F>
+        BuildStats build(size_t n, size_t classes_count, F get) {
+            return build(n, classes_count, std::span<F>(&get, 1));
+        }
+
+        /*
+         * Builds with one worker thread per getter, each of which must be safe to call concurrently with the
+         * others. The output does not depend on the number of threads.
+         */
+        template<typename F>
+        BuildStats build(size_t n, size_t classes_count, std::span<F> gets) {
+            rocksdb::StopWatchNano timer(true);
+
+            BuildStats stats;
+            stats.keys = n;
+            auto [hashCSF, labelCSF, probabilitiesCSF] = gets[0](0);
+            init_coder(classes_count, probabilitiesCSF);
+            const size_t threads = gets.size();
+            std::vector<Coding> coders(threads, coder);
+            std::vector<BuildStats> workerStats(threads);
+
+            // the filter 0s are stored, so the correction code is exactly what a query of the filter code yields
+            auto encoded = std::make_unique<EncodedKey[]>(n);
+            parallel_for(n, threads, [&](size_t begin, size_t end, size_t t) {
+                FilterDecisions decisions;
+                for (size_t i = begin; i < end; ++i) {
+                    auto [hash, label, probabilities] = gets[t](i);
+                    auto [code, filterLength, bitsSet] = coders[t].encode_once_filter(probabilities, label, decisions);
+                    auto [correction, correctionLength] = Coding::encode_once_corrected_code(decisions, code);
+                    workerStats[t].filterBitsSet.add(bitsSet);
+                    workerStats[t].filterLengths.add(filterLength);
+                    workerStats[t].correctionLengths.add(correctionLength);
+                    encoded[i] = {hash, correction, uint16_t(code), uint8_t(correctionLength)};
+                }
+            });
+            for (size_t t = 0; t < threads; ++t) {
+                stats.filterLengths.merge(workerStats[t].filterLengths);
+                stats.filterBitsSet.merge(workerStats[t].filterBitsSet);
+                stats.correctionLengths.merge(workerStats[t].correctionLengths);
+            }
+            filterBits = stats.filterLengths.max();
+            const size_t maxLength = filterBits + stats.correctionLengths.max();
+            if (maxLength >= 64)
+                throw std::runtime_error("Codes of " + std::to_string(maxLength) + " bits do not fit into one row");
+
+            auto rows = std::make_unique<Row[]>(n);
+            parallel_for(n, threads, [&](size_t begin, size_t end, size_t) {
+                for (size_t i = begin; i < end; ++i) {
+                    const EncodedKey &key = encoded[i];
+                    rows[i] = Backend::make_row(key.hash, key.filter | (key.correction << filterBits),
+                                                filterBits + key.correctionLength);
+                }
+            });
+            encoded.reset();
+            stats.peakTemporaryBytes = build_bytes(n);
+            stats.encodeNanos = timer.ElapsedNanos(true);
+
+            retrieval = Backend(n, maxLength);
+            retrieval.AddRange(rows.get(), rows.get() + n);
+            retrieval.BackSubst();
+            rows.reset();
+            place_table();
+            stats.correctionRibbonNanos = timer.ElapsedNanos(true);
+
+            statistic_bits_input = n * filterBits + stats.correctionLengths.total_bits();
+            stats.correctionRibbonBytes = retrieval.Size();
+            return stats;
+        }
+
+        /** Mutable decoding state of a query, one per querying thread. */
+        using Scratch = Coding;
+
+        Scratch make_scratch() const {
+            return coder;
+        }
+
+        std::pair<uint64_t, uint64_t> query_storage(uint64_t hash) const {
+            const uint64_t value = retrieval.QueryRetrieval(hash);
+            return {value >> filterBits, value & filter_mask()};
+        }
+
+        /** Starts loading the row of both codes, without waiting for it. */
+        void prefetch(uint64_t hash) const {
+            retrieval.prefetch(hash);
+        }
+
+        /** The same as prefetch(), as the filter code shares its row with the correction code. */
+        void prefetch_filter(uint64_t hash) const {
+            retrieval.prefetch(hash);
+        }
+
+        uint64_t query(uint64_t hash, std::span<float> probabilities) {
+            return query(hash, probabilities, coder);
+        }
+
+        uint64_t query(uint64_t hash, std::span<float> probabilities, Scratch &scratch) const {
+            const uint64_t value = profile_phase<QueryPhase::RETRIEVAL>([&] {
+                return uint64_t(retrieval.QueryRetrieval(hash));
+            });
+            return profile_phase<QueryPhase::DECODE>([&] {
+                return scratch.decode_once_lazy(probabilities, [&] { return value >> filterBits; },
+                                                value & filter_mask());
+            });
+        }
+
+        size_t size_in_bytes() const {
+            return retrieval.Size();
+        }
+
+        void save(BinaryWriter &out) const {
+            out.write_string(get_name());
+            out.write<uint64_t>(classes);
+            out.write<uint64_t>(statistic_bits_input);
+            out.write<uint64_t>(filterBits);
+            out.write<uint64_t>(coder_frequencies.size());
+            out.write_bytes(std::as_bytes(std::span(coder_frequencies)));
+            retrieval.save(out);
+        }
+
+        void load(BinaryReader &in) {
+            if (in.read_string() != get_name())
+                throw std::runtime_error("The LSF file was written with a different storage");
+            classes = in.read<uint64_t>();
+            statistic_bits_input = in.read<uint64_t>();
+            filterBits = in.read<uint64_t>();
+            coder_frequencies.resize(in.read<uint64_t>());
+            auto frequencies = in.read_bytes(coder_frequencies.size() * sizeof(float));
+            std::memcpy(coder_frequencies.data(), frequencies.data(), frequencies.size());
+            coder = Coding(classes, std::span(coder_frequencies));
+            retrieval = Backend();
+            HugePageScope table(tablePages);
+            retrieval = Backend::load(in);
+            hugePageTableBytes = table.allocated_bytes();
+        }
+
+        size_t get_statistic_bits_input() const {
+            return statistic_bits_input;
+        }
+
+        static const std::string get_name() {
+            std::string name = "CoLocated-" + Coding::get_name();
+            if constexpr (!std::is_same_v<Backend, BuRRVLRBackend>)
+                name += "-" + Backend::get_name();
+            return name;
+        }
+
+    private:
+
+        /** A key between encoding and the row of the retrieval, whose layout depends on the longest filter code. */
+        struct EncodedKey {
+            uint64_t hash;
+            uint64_t correction;
+            uint16_t filter;
+            uint8_t correctionLength;
+        };
+
+        uint64_t filter_mask() const {
+            return (uint64_t(1) << filterBits) - 1;
+        }
+
+        void init_coder(size_t classes_count, std::span<float> probabilities) {
+            // the probabilities of the first key are the relative frequencies when used as a CSF
+            coder = Coding(classes_count, probabilities);
+            classes = classes_count;
+            coder_frequencies.assign(probabilities.begin(), probabilities.end());
+        }
+
+        /* Moves the finished table onto huge pages by reloading it, see FilteredLSFStorage::place_tables(). */
+        void place_table() {
+            hugePageTableBytes = 0;
+            if (tablePages == HugePageMode::NONE)
+                return;
+            std::ostringstream os;
+            BinaryWriter out(os);
+            retrieval.save(out);
+            const std::string image = std::move(os).str();
+            retrieval = Backend();
+            BinaryReader in(std::as_bytes(std::span(image)));
+            HugePageScope table(tablePages);
+            retrieval = Backend::load(in);
+            hugePageTableBytes = table.allocated_bytes();
+        }
+    };
+}
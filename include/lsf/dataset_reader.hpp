@@ -1,19 +1,32 @@
 #pragma once
 
 #include <cstdint>
-#include <fstream>
+#include <cstring>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <span>
 #include <vector>
 
+#include "mapped_file.hpp"
+
 namespace lsf {
+/**
+ * Reads the _X.lrbin and _y.lrbin files of a dataset through read-only mappings. Examples and labels are spans
+ * into the mapped files, so nothing is copied and the pages are shared with the page cache.
+ */
 class BinaryDatasetReader {
     using label_type = uint16_t;
-    std::vector<label_type> labels;
-    std::vector<float> examples;
-    size_t num_examples;
-    size_t num_features;
-    size_t num_classes;
+    static constexpr size_t EXAMPLES_HEADER_BYTES = 2 * sizeof(size_t);
+    static constexpr size_t LABELS_HEADER_BYTES = sizeof(label_type);
+
+    MappedFile examplesFile;
+    MappedFile labelsFile;
+    std::span<const float> examples;
+    std::span<const label_type> labels;
+    size_t num_examples = 0;
+    size_t num_features = 0;
+    size_t num_classes = 0;
 
 public:
     BinaryDatasetReader() = default;
@@ -22,37 +35,89 @@ public:
         auto examples_path = path + "_X.lrbin";
         auto labels_path = path + "_y.lrbin";
 
-        std::ifstream file(examples_path, std::ios::binary);
-        if (!file.is_open())
-            throw std::runtime_error("Could not open examples file at " + examples_path);
-
-        file.read(reinterpret_cast<char *>(&num_examples), sizeof(size_t));
-        file.read(reinterpret_cast<char *>(&num_features), sizeof(size_t));
-        examples.resize(num_examples * num_features);
-        file.read(reinterpret_cast<char *>(&examples[0]), num_examples * num_features * sizeof(float));
-        file.close();
+        examplesFile = MappedFile(examples_path);
+        auto exampleBytes = examplesFile.bytes();
+        if (exampleBytes.size() < EXAMPLES_HEADER_BYTES)
+            throw std::runtime_error("Truncated examples file at " + examples_path);
+        std::memcpy(&num_examples, exampleBytes.data(), sizeof(size_t));
+        std::memcpy(&num_features, exampleBytes.data() + sizeof(size_t), sizeof(size_t));
+        if (exampleBytes.size() < EXAMPLES_HEADER_BYTES + num_examples * num_features * sizeof(float))
+            throw std::runtime_error("Truncated examples file at " + examples_path);
+        examples = {reinterpret_cast<const float *>(exampleBytes.data() + EXAMPLES_HEADER_BYTES),
+                    num_examples * num_features};
 
-        file.open(labels_path, std::ios::binary);
-        if (!file.is_open())
-            throw std::runtime_error("Could not open labels file at " + labels_path);
-
-        labels.resize(num_examples);
+        labelsFile = MappedFile(labels_path);
+        auto labelBytes = labelsFile.bytes();
+        if (labelBytes.size() < LABELS_HEADER_BYTES + num_examples * sizeof(label_type))
+            throw std::runtime_error("Truncated labels file at " + labels_path);
         label_type n_classes;
-        file.read(reinterpret_cast<char *>(&n_classes), sizeof(label_type));
-        file.read(reinterpret_cast<char *>(&labels[0]), num_examples * sizeof(label_type));
+        std::memcpy(&n_classes, labelBytes.data(), sizeof(label_type));
+        labels = {reinterpret_cast<const label_type *>(labelBytes.data() + LABELS_HEADER_BYTES), num_examples};
         num_classes = n_classes;
     }
 
+    /** Passes an access pattern hint to both files, e.g., MADV_SEQUENTIAL for build scans, MADV_RANDOM for queries. */
+    void advise(int advice) const {
+        examplesFile.advise(advice);
+        labelsFile.advise(advice);
+    }
+
     size_t size() const { return num_examples; }
 
     size_t features_count() const { return num_features; }
 
     size_t classes_count() const { return num_classes; }
 
-    std::span<const float> get_example(size_t i) const { return {&examples[i * num_features], num_features}; }
+    std::span<const float> get_example(size_t i) const { return examples.subspan(i * num_features, num_features); }
 
     label_type get_label(size_t i) const { return labels[i]; }
 
-    const std::vector<label_type> &get_labels() const { return labels; }
+    std::span<const label_type> get_labels() const { return labels; }
+};
+
+/**
+ * Reads the _X.sux4j and _y.sux4j files given to the Sux4J compressed functions: one key per line, and one big-endian
+ * 64-bit value per key. Keys are views into the mapped key file, only the offsets of the lines are stored.
+ */
+class Sux4jDatasetReader {
+    MappedFile keysFile;
+    MappedFile valuesFile;
+    // start of every line, followed by one past the end of the last line plus its newline
+    std::vector<uint64_t> lineStarts;
+
+public:
+    Sux4jDatasetReader() = default;
+
+    Sux4jDatasetReader(const std::string &path) : keysFile(path + "_X.sux4j"), valuesFile(path + "_y.sux4j") {
+        auto text = reinterpret_cast<const char *>(keysFile.bytes().data());
+        const size_t size = keysFile.size();
+        size_t begin = 0;
+        while (begin < size) {
+            lineStarts.push_back(begin);
+            auto newline = static_cast<const char *>(std::memchr(text + begin, '\n', size - begin));
+            begin = newline ? newline - text + 1 : size + 1;
+        }
+        lineStarts.push_back(begin);
+    }
+
+    void advise(int advice) const {
+        keysFile.advise(advice);
+        valuesFile.advise(advice);
+    }
+
+    size_t size() const { return lineStarts.size() - 1; }
+
+    size_t values_count() const { return valuesFile.size() / sizeof(uint64_t); }
+
+    std::string_view get_key(size_t i) const {
+        auto text = reinterpret_cast<const char *>(keysFile.bytes().data());
+        return {text + lineStarts[i], lineStarts[i + 1] - lineStarts[i] - 1};
+    }
+
+    int64_t get_value(size_t i) const {
+        uint64_t value;
+        std::memcpy(&value, valuesFile.bytes().data() + i * sizeof(uint64_t), sizeof(uint64_t));
+        return static_cast<int64_t>(__builtin_bswap64(value));
+    }
 };
 }
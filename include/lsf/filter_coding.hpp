@@ -9,6 +9,10 @@
 #include <functional>
 #include <iostream>
 #include <span>
+#include <bit>
+#include <limits>
+#include <stdexcept>
+#include <immintrin.h>
 #include "bits.hpp"
 
 /*
@@ -39,6 +43,17 @@ namespace lsf {
         LengthType length;
     };
 
+    /*
+     * The decisions taken while encoding the filter code of a key: the branch taken at each depth and the layout of
+     * the filter code. This is all that is needed to derive the correction code later without invoking the model.
+     */
+    struct FilterDecisions {
+        uint64_t bits;       // branch taken at each depth
+        uint64_t filtered;   // depths that have at least one filter bit
+        uint16_t filterEnds; // last position of each field in the filter code
+        uint8_t depth;
+    };
+
     template<typename OtherFilter>
     class FilterLengthOnlyRootWrapper {
     public:
@@ -119,6 +134,9 @@ namespace lsf {
         uint64_t encodeCode;
         bool lastEncBit;
 
+        // the tree does not depend on the key, so BitWiseFilterCoding can precompute a decoding table for it
+        static constexpr bool STATIC_TREE = true;
+
         FilterHuffmanCoderCSF() {}
 
         FilterHuffmanCoderCSF(size_t, const std::span<Frequency> &f) {
@@ -204,22 +222,55 @@ namespace lsf {
         }
     };
 
+    /**
+     * Index of the first probability above 0.5, or f.size() if there is none. At most one symbol of a distribution
+     * can be above 0.5, so this finds its dominant symbol if it has one.
+     */
+    template<typename Frequency>
+    size_t find_dominant(std::span<const Frequency> f) {
+        size_t i = 0;
+        if constexpr (std::is_same_v<Frequency, float>) {
+#ifdef __AVX512F__
+            const __m512 half = _mm512_set1_ps(0.5f);
+            for (; i + 16 <= f.size(); i += 16) {
+                __mmask16 above = _mm512_cmp_ps_mask(_mm512_loadu_ps(f.data() + i), half, _CMP_GT_OQ);
+                if (above)
+                    return i + std::countr_zero(unsigned(above));
+            }
+#elif defined(__AVX2__)
+            const __m256 half = _mm256_set1_ps(0.5f);
+            for (; i + 8 <= f.size(); i += 8) {
+                int above = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(f.data() + i), half, _CMP_GT_OQ));
+                if (above)
+                    return i + std::countr_zero(unsigned(above));
+            }
+#endif
+        }
+        for (; i < f.size(); ++i) {
+            if (f[i] > 0.5f)
+                return i;
+        }
+        return f.size();
+    }
+
     template<typename Symbol = uint32_t, typename Frequency = float>
     class FilterFanoCoder {
+        /*
+         * The symbols are bucket sorted by the binary exponent of their probability and get increasing codes of
+         * BUCKETS + 1 bits. The current node of the code tree is a range [leftBound, rightBound] of the sorted
+         * symbols whose codes agree above currentBitPos, so the split point of a level is found by binary search on
+         * the codes. The probability mass left of the split is summed in the same order as by a linear scan, and
+         * the partial sums are kept, as they stay valid for all levels that share the left bound.
+         */
+        static constexpr int BUCKETS = 10;
 
-        struct Elem {
-            Frequency f;
-            Symbol s;
-            uint64_t code;
-
-        public:
-            bool getCodeBit(size_t pos) const {
-                return (code >> pos) & 1;
-            }
-        };
-
-        size_t n;
-        std::vector<Elem> sorted;
+        std::vector<uint8_t> buckets;   // by symbol
+        std::vector<Frequency> freqs;   // by sorted position
+        std::vector<Symbol> symbols;    // by sorted position
+        std::vector<uint32_t> codes;    // by sorted position
+        std::vector<Frequency> sums;    // sums[j] = f[sumBase] + ... + f[j - 1], valid up to sumEnd
+        size_t sumBase;
+        size_t sumEnd;
 
         bool encodeBit;
         bool flipNext;
@@ -230,89 +281,154 @@ namespace lsf {
         Frequency lastCumFreq;
         size_t currentBitPos;
 
-        static constexpr int BUCKETS = 10;
         std::array<size_t, BUCKETS> bucketCnt;
 
-        Elem target;
+        uint32_t targetCode;
 
-        int getBucket(Frequency f) {
-            int exp;
-            frexp(f, &exp);
-            if (f == 0) [[unlikely]] {
-                return BUCKETS - 1;
-            } else if (f == 1) [[unlikely]] {
-                return 0;
-            }
-            return std::min(BUCKETS - 1, -exp);
+        /** min(BUCKETS - 1, -exponent) as by frexp, 0 for 1 and BUCKETS - 1 for 0, read from the float bits. */
+        static uint8_t getBucket(float f) {
+            int biased = int((std::bit_cast<uint32_t>(f) >> 23) & 0xFF);
+            return uint8_t(std::clamp(126 - biased, 0, BUCKETS - 1));
         }
 
     public:
+        static constexpr Symbol NO_SYMBOL = Symbol(-1);
 
         FilterFanoCoder() {}
 
-        FilterFanoCoder(size_t n, const std::span<Frequency> &) : n(n) {
-            sorted.resize(n);
+        FilterFanoCoder(size_t n, const std::span<Frequency> &) {
+            resize(n);
         }
 
         template<bool encode = false>
         void init(const std::span<Frequency> &f, Symbol encodeSymbol = -1) {
+            init_buckets(f);
+            init_order<encode>(f, encodeSymbol);
+        }
+
+        /*
+         * First half of init(), a single pass over the probabilities: the bucket of every symbol and the bucket
+         * histogram. It also returns the dominant symbol as by find_dominant, or NO_SYMBOL, which lets
+         * Filter50PercentWrapper avoid a scan of its own and only finish the initialization with init_order() when
+         * it is disarmed.
+         */
+        Symbol init_buckets(const std::span<Frequency> &f) {
+            const size_t k = f.size();
+            if (buckets.size() < k) [[unlikely]]
+                resize(k);
+            Symbol heavy = NO_SYMBOL;
             bucketCnt = {};
+            size_t i = 0;
+            if constexpr (std::is_same_v<Frequency, float>) {
+#ifdef __AVX512F__
+                const __m512i bias = _mm512_set1_epi32(126);
+                const __m512i maxBucket = _mm512_set1_epi32(BUCKETS - 1);
+                const __m512 half = _mm512_set1_ps(0.5f);
+                for (; i + 16 <= k; i += 16) {
+                    __m512 v = _mm512_loadu_ps(f.data() + i);
+                    __m512i exponent = _mm512_srli_epi32(_mm512_slli_epi32(_mm512_castps_si512(v), 1), 24);
+                    __m512i b = _mm512_min_epi32(_mm512_max_epi32(_mm512_sub_epi32(bias, exponent),
+                                                                  _mm512_setzero_si512()), maxBucket);
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(buckets.data() + i), _mm512_cvtepi32_epi8(b));
+                    for (int bucket = 0; bucket < BUCKETS; ++bucket)
+                        bucketCnt[bucket] += std::popcount(unsigned(
+                                _mm512_cmpeq_epi32_mask(b, _mm512_set1_epi32(bucket))));
+                    __mmask16 above = _mm512_cmp_ps_mask(v, half, _CMP_GT_OQ);
+                    if (above && heavy == NO_SYMBOL)
+                        heavy = Symbol(i + std::countr_zero(unsigned(above)));
+                }
+#elif defined(__AVX2__)
+                const __m256i bias = _mm256_set1_epi32(126);
+                const __m256i maxBucket = _mm256_set1_epi32(BUCKETS - 1);
+                const __m256 half = _mm256_set1_ps(0.5f);
+                // the low byte of every 32-bit lane, gathered into the low 4 bytes of each 128-bit half
+                const __m256i lowBytes = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                          0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+                const __m256i lowDwords = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+                for (; i + 8 <= k; i += 8) {
+                    __m256 v = _mm256_loadu_ps(f.data() + i);
+                    __m256i exponent = _mm256_srli_epi32(_mm256_slli_epi32(_mm256_castps_si256(v), 1), 24);
+                    __m256i b = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(bias, exponent),
+                                                                  _mm256_setzero_si256()), maxBucket);
+                    for (int bucket = 0; bucket < BUCKETS; ++bucket)
+                        bucketCnt[bucket] += std::popcount(unsigned(_mm256_movemask_ps(
+                                _mm256_castsi256_ps(_mm256_cmpeq_epi32(b, _mm256_set1_epi32(bucket))))));
+                    __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(b, lowBytes), lowDwords);
+                    _mm_storel_epi64(reinterpret_cast<__m128i *>(buckets.data() + i), _mm256_castsi256_si128(packed));
+                    int above = _mm256_movemask_ps(_mm256_cmp_ps(v, half, _CMP_GT_OQ));
+                    if (above && heavy == NO_SYMBOL)
+                        heavy = Symbol(i + std::countr_zero(unsigned(above)));
+                }
+#endif
+            }
+            for (; i < k; ++i) {
+                buckets[i] = getBucket(f[i]);
+                bucketCnt[buckets[i]]++;
+                if (f[i] > 0.5f && heavy == NO_SYMBOL)
+                    heavy = Symbol(i);
+            }
+            return heavy;
+        }
 
+        /** Second half of init(): sorts the symbols by bucket and assigns the codes. */
+        template<bool encode = false>
+        void init_order(const std::span<Frequency> &f, Symbol encodeSymbol = -1) {
+            const size_t k = f.size();
             flipNext = false;
             currentBitPos = BUCKETS;
             absoluteFreq = 0;
             lastCumFreq = 1.0;
             leftBound = 0;
-            rightBound = f.size() - 1;
-
+            rightBound = k - 1;
+            sumBase = sumEnd = 0;
+            sums[0] = 0;
 
-            for (Symbol i = 0; i < f.size(); ++i) {
-                int bucket = getBucket(f[i]);
-                bucketCnt[bucket]++;
-            }
+            std::array<size_t, BUCKETS> offsets;
             size_t sum = 0;
-            for (size_t i = 0; i < BUCKETS; ++i) {
-                size_t offset = sum;
-                sum += bucketCnt[i];
-                bucketCnt[i] = offset;
+            for (size_t b = 0; b < BUCKETS; ++b) {
+                offsets[b] = sum;
+                sum += bucketCnt[b];
             }
-            for (Symbol i = 0; i < f.size(); ++i) {
-                int b = getBucket(f[i]);
-                size_t pos = bucketCnt[b]++;
-                sorted[pos].s = i;
-                sorted[pos].f = f[i];
+            for (Symbol i = 0; i < k; ++i) {
+                size_t pos = offsets[buckets[i]]++;
+                symbols[pos] = i;
+                freqs[pos] = f[i];
             }
 
+            // the buckets are contiguous now, so the code increment only changes between them
             uint64_t code = 0;
-            for (size_t i = 0; i < f.size(); ++i) {
-                sorted[i].code = std::min((uint64_t(2) << BUCKETS) - f.size() + i, code);
-                if constexpr (encode) {
-                    if (sorted[i].s == encodeSymbol) {
-                        target = sorted[i];
+            size_t pos = 0;
+            for (size_t b = 0; b < BUCKETS; ++b) {
+                for (size_t end = pos + bucketCnt[b]; pos < end; ++pos) {
+                    codes[pos] = uint32_t(std::min((uint64_t(2) << BUCKETS) - k + pos, code));
+                    code += uint64_t(1) << (BUCKETS - b);
+                }
+            }
+            if constexpr (encode) {
+                for (size_t i = 0; i < k; ++i) {
+                    if (symbols[i] == encodeSymbol) {
+                        targetCode = codes[i];
                     }
                 }
-                code += uint64_t(1) << (BUCKETS - getBucket(sorted[i].f));
             }
-            assert(sorted[n - 1].code < (uint64_t(2) << BUCKETS));
+            assert(codes[k - 1] < (uint64_t(2) << BUCKETS));
         }
 
         float getRelProbabilityAndAdvance() {
-            absoluteFreq = 0;
-            int index = leftBound;
-            while (true) {
-                const Elem e = sorted[index];
-                if (e.getCodeBit(currentBitPos)) [[unlikely]] {
-                    break;
-                }
-                absoluteFreq += e.f;
-                index++;
-                if (index == rightBound + 1) [[unlikely]] { // all 0 skip
-                    absoluteFreq = 0;
-                    index = leftBound;
-                    currentBitPos--;
-                }
+            // skip the levels at which all codes of the range have a 0
+            while (((codes[rightBound] >> currentBitPos) & 1) == 0)
+                currentBitPos--;
+            const uint32_t split = ((codes[leftBound] >> currentBitPos) | 1) << currentBitPos;
+            center = std::lower_bound(codes.begin() + leftBound, codes.begin() + rightBound, split) - codes.begin();
+
+            if (sumBase != leftBound) {
+                sumBase = sumEnd = leftBound;
+                sums[sumBase] = 0;
             }
-            center = index;
+            for (; sumEnd < center; ++sumEnd)
+                sums[sumEnd + 1] = sums[sumEnd] + freqs[sumEnd];
+            absoluteFreq = sums[center];
+
             float currentRelFeq = absoluteFreq / lastCumFreq;
             currentRelFeq = std::max(std::min(currentRelFeq, 1.0f - EPS), EPS);
             flipNext = currentRelFeq > 0.5f;
@@ -327,7 +443,7 @@ namespace lsf {
         }
 
         void nextEncodeBit() {
-            encodeBit = target.getCodeBit(currentBitPos) ^ flipNext;
+            encodeBit = ((targetCode >> currentBitPos) & 1) ^ flipNext;
             nextBit(encodeBit);
         }
 
@@ -348,12 +464,22 @@ namespace lsf {
         }
 
         Symbol getResult() {
-            return sorted[leftBound].s;
+            return symbols[leftBound];
         }
 
         static const std::string get_name() {
             return "Fano";
         }
+
+    private:
+
+        void resize(size_t n) {
+            buckets.resize(n);
+            freqs.resize(n);
+            symbols.resize(n);
+            codes.resize(n);
+            sums.resize(n + 1);
+        }
     };
 
 
@@ -361,66 +487,79 @@ namespace lsf {
     class FilterHuffmanCoder {
 
     public:
+        /*
+         * The tree of k symbols is stored in a buffer of 2k-1 nodes allocated once at construction: leaves are at
+         * the index of their symbol, inner nodes follow in creation order. Ties between equal probabilities are
+         * broken by running std::push_heap and std::pop_heap on a fixed buffer exactly like the
+         * std::priority_queue of the previous implementation did, so that the resulting codes do not change.
+         */
         struct Node {
-            Symbol s;
-            size_t n1;
-            size_t n2;
-            size_t parent;
-            bool bitRelParent;
             Frequency p;
             float relP;
-            size_t index;
+            uint32_t n1;
+            uint32_t n2;
+            uint32_t parent;
+            bool bitRelParent;
             bool leaf;
         };
 
-        class Compare {
-        public:
-            bool operator()(Node a, Node b) {
-                return a.p > b.p;
-                //return a.index > b.index;
-            }
+        struct HeapEntry {
+            Frequency p;
+            uint32_t index;
         };
 
+        static bool compare(const HeapEntry &a, const HeapEntry &b) {
+            return a.p > b.p;
+        }
+
+        /* The number of nodes of a tree with n leaves. A tree without leaves has no root to decode from. */
+        static size_t tree_size(size_t n) {
+            if (n == 0)
+                throw std::runtime_error("A Huffman coder needs at least one symbol");
+            return 2 * n - 1;
+        }
+
+        static constexpr Frequency MIN_PROBABILITY = Frequency(1.0 / 1024);
+
         std::vector<Node> tree;
-        std::priority_queue<Node, std::vector<Node>, Compare> nodes;
-        Node root;
-        Node currentDecodingNode;
+        std::vector<HeapEntry> heap;
+        uint32_t root;
+        uint32_t currentDecodingNode;
 
         uint64_t encodeCode;
         bool lastEncBit;
 
         FilterHuffmanCoder() {}
 
-        FilterHuffmanCoder(size_t, const std::span<Frequency> &) {}
+        FilterHuffmanCoder(size_t n, const std::span<Frequency> &) : tree(tree_size(n)), heap(n) {}
 
 
         template<bool encode = false>
         void init(const std::span<Frequency> &f, Symbol s = -1) {
-            tree.clear();
-            for (Symbol i = 0; i < f.size(); ++i) {
-                Node n{i, 0, 0, 0, 0, std::max(Frequency(pow(2.0, -10.0)), f[i]), 0, i, true};
-                nodes.push(n);
-                tree.push_back(n);
+            const uint32_t k = f.size();
+            if (tree.size() + 1 < 2 * size_t(k)) [[unlikely]] {
+                tree.resize(tree_size(k));
+                heap.resize(k);
             }
-            while (nodes.size() > 1) {
-                Node a = nodes.top();
-                nodes.pop();
-                Node b = nodes.top();
-                nodes.pop();
-
-                /*if (a.p > b.p) {
-                    Node c = a;
-                    a = b;
-                    b = c;
-                }*/
-
-                a.bitRelParent = 0;
-                a.parent = tree.size();
-                b.bitRelParent = 1;
-                b.parent = tree.size();
-
-                tree[a.index] = a;
-                tree[b.index] = b;
+            HeapEntry *h = heap.data();
+            size_t heapSize = 0;
+            for (uint32_t i = 0; i < k; ++i) {
+                Frequency p = std::max(MIN_PROBABILITY, f[i]);
+                tree[i] = {p, 0, 0, 0, 0, 0, true};
+                h[heapSize++] = {p, i};
+                std::push_heap(h, h + heapSize, compare);
+            }
+            uint32_t next = k;
+            while (heapSize > 1) {
+                std::pop_heap(h, h + heapSize--, compare);
+                HeapEntry a = h[heapSize];
+                std::pop_heap(h, h + heapSize--, compare);
+                HeapEntry b = h[heapSize];
+
+                tree[a.index].bitRelParent = 0;
+                tree[a.index].parent = next;
+                tree[b.index].bitRelParent = 1;
+                tree[b.index].parent = next;
 
                 float relp;
                 if (a.p + b.p == 0) {
@@ -429,31 +568,31 @@ namespace lsf {
                     relp = a.p / (a.p + b.p);
                 }
                 relp = std::max(std::min(relp, 1.0f - EPS), EPS);
-                Node parent{0, a.index, b.index, 0, 0, a.p + b.p, relp, tree.size(), false};
-                tree.push_back(parent);
-                nodes.push(parent);
+                tree[next] = {a.p + b.p, relp, a.index, b.index, 0, 0, false};
+                h[heapSize++] = {a.p + b.p, next};
+                std::push_heap(h, h + heapSize, compare);
+                next++;
             }
-            root = nodes.top();
-            nodes.pop();
+            root = h[0].index;
             currentDecodingNode = root;
 
             if constexpr (encode) {
-                Node current = tree[s];
-                while (current.index != root.index) {
-                    bool b = current.bitRelParent;
+                encodeCode = 0;
+                uint32_t current = s;
+                while (current != root) {
                     encodeCode <<= 1;
-                    encodeCode |= b;
-                    current = tree[current.parent];
+                    encodeCode |= tree[current].bitRelParent;
+                    current = tree[current].parent;
                 }
             }
         }
 
         float getRelProbabilityAndAdvance() {
-            return currentDecodingNode.relP;
+            return tree[currentDecodingNode].relP;
         }
 
         bool hasFinished() {
-            return currentDecodingNode.leaf;
+            return tree[currentDecodingNode].leaf;
         }
 
         void nextEncodeBit() {
@@ -463,7 +602,8 @@ namespace lsf {
         }
 
         void nextBit(bool bit) {
-            currentDecodingNode = tree[bit ? currentDecodingNode.n2 : currentDecodingNode.n1];
+            const Node &node = tree[currentDecodingNode];
+            currentDecodingNode = bit ? node.n2 : node.n1;
         }
 
         bool getBit() {
@@ -471,7 +611,7 @@ namespace lsf {
         }
 
         Symbol getResult() {
-            return currentDecodingNode.s;
+            return currentDecodingNode;
         }
 
         static const std::string get_name() {
@@ -486,6 +626,12 @@ namespace lsf {
         bool exploded;
         Symbol armedSymbol;
         std::span<Frequency> fs;
+
+        // the coder finds the symbol above 0.5 in its first init pass and can finish the init later
+        static constexpr bool SPLIT_INIT = requires(Coder<Symbol, Frequency> c, std::span<Frequency> f) {
+            c.init_buckets(f);
+            c.init_order(f);
+        };
     public:
 
         Filter50PercentWrapper(){}
@@ -504,13 +650,21 @@ namespace lsf {
                     armedSymbol = encodeSymbol;
                     return;
                 }
+            } else if constexpr (SPLIT_INIT) {
+                Symbol heavy = coder.init_buckets(f);
+                if (heavy != Coder<Symbol, Frequency>::NO_SYMBOL) {
+                    armed = true;
+                    armedSymbol = heavy;
+                } else {
+                    coder.init_order(f);
+                }
+                return;
             } else {
-                for (Symbol i = 0; i < f.size(); i++) {
-                    if (f[i] > 0.5f) {
-                        armed = true;
-                        armedSymbol = i;
-                        return;
-                    }
+                size_t dominant = find_dominant(std::span<const Frequency>(f));
+                if (dominant < f.size()) {
+                    armed = true;
+                    armedSymbol = Symbol(dominant);
+                    return;
                 }
             }
             coder.template init<encode>(f, encodeSymbol);
@@ -541,9 +695,12 @@ namespace lsf {
                     exploded = true;
                     return;
                 } else {
-                    // dissarm
+                    // dissarm, the buckets of a split init are still those of fs
                     armed = false;
-                    coder.init(fs);
+                    if constexpr (SPLIT_INIT)
+                        coder.init_order(fs);
+                    else
+                        coder.init(fs);
                     coder.getRelProbabilityAndAdvance();
                 }
             }
@@ -566,8 +723,130 @@ namespace lsf {
 
     template<template<typename S, typename F> typename Coder, typename FilterLengthStrategy = FilterLengthStrategyOpt, typename Symbol = uint32_t, typename Frequency = float, size_t MAX_FILTER_CODE_LENGTH = COMMON_FILTER_LIMIT>
     class BitWiseFilterCoding {
+        static_assert(MAX_FILTER_CODE_LENGTH <= 8 * sizeof(FilterDecisions::filterEnds),
+                      "FilterDecisions cannot mark the field ends of longer filter codes");
+
         Coder<Symbol, Frequency> coder;
 
+        /*
+         * Decoding table for coders with a static tree. There, the filter bit length and the offset into the filter
+         * code are fixed for each node. For every inner node and every window of the next TABLE_FILTER_BITS filter
+         * bits and TABLE_CORRECTION_BITS correction bits, the table holds the node reached after all the levels that
+         * can be resolved within the window, and the number of correction bits consumed on the way.
+         */
+        static constexpr size_t TABLE_FILTER_BITS = 4;
+        static constexpr size_t TABLE_CORRECTION_BITS = 3;
+        static constexpr size_t TABLE_ROW = size_t(1) << (TABLE_FILTER_BITS + TABLE_CORRECTION_BITS);
+
+        struct TableNode {
+            uint32_t rowOrSymbol; // row in the table for inner nodes, symbol for leaves
+            uint16_t children[2];
+            uint8_t filterOffset;
+            uint8_t filterLength;
+            bool leaf;
+        };
+
+        std::vector<TableNode> tableNodes; // in BFS order, the root is at 0
+        std::vector<uint32_t> table;       // node | (consumed correction bits << 16)
+
+        template<typename Tree>
+        void build_decoding_table(const Tree &tree, size_t root) {
+            if (tree.size() > std::numeric_limits<uint16_t>::max())
+                return;
+            std::vector<size_t> order{root};
+            std::vector<size_t> depths{0};
+            tableNodes.push_back({0, {0, 0}, 0, 0, tree[root].leaf});
+            size_t rows = 0;
+            for (size_t i = 0; i < order.size(); ++i) {
+                const auto &node = tree[order[i]];
+                if (tableNodes[i].leaf) {
+                    tableNodes[i].rowOrSymbol = node.s;
+                    continue;
+                }
+                uint8_t filterLength = getFilterBits(tableNodes[i].filterOffset, node.relP, depths[i]);
+                tableNodes[i].filterLength = filterLength;
+                tableNodes[i].rowOrSymbol = filterLength <= TABLE_FILTER_BITS ? rows++ : -1;
+                for (size_t bit = 0; bit < 2; ++bit) {
+                    size_t child = bit ? node.n2 : node.n1;
+                    tableNodes[i].children[bit] = order.size();
+                    order.push_back(child);
+                    depths.push_back(depths[i] + 1);
+                    tableNodes.push_back({0, {0, 0}, uint8_t(tableNodes[i].filterOffset + filterLength), 0,
+                                          tree[child].leaf});
+                }
+            }
+
+            table.resize(rows * TABLE_ROW);
+            for (uint32_t v = 0; v < tableNodes.size(); ++v) {
+                if (tableNodes[v].leaf || tableNodes[v].filterLength > TABLE_FILTER_BITS)
+                    continue;
+                for (uint32_t window = 0; window < TABLE_ROW; ++window) {
+                    uint32_t u = v;
+                    size_t filterPos = 0;
+                    size_t correctionPos = 0;
+                    while (!tableNodes[u].leaf) {
+                        size_t length = tableNodes[u].filterLength;
+                        if (filterPos + length > TABLE_FILTER_BITS)
+                            break;
+                        uint64_t filterBits = (window >> filterPos) & ((uint64_t(1) << length) - 1);
+                        bool bit = true;
+                        if (filterBits == ((uint64_t(1) << length) - 1)) {
+                            if (correctionPos == TABLE_CORRECTION_BITS)
+                                break;
+                            bit = (window >> (TABLE_FILTER_BITS + correctionPos)) & 1;
+                            correctionPos++;
+                        }
+                        filterPos += length;
+                        u = tableNodes[u].children[bit];
+                    }
+                    table[tableNodes[v].rowOrSymbol * TABLE_ROW + window] = u | (correctionPos << 16);
+                }
+            }
+        }
+
+        /*
+         * The correction code is only requested from correction() at the first node that consumes correction bits.
+         * Until then, the table is indexed with zero correction bits, which is exact as long as none are consumed.
+         */
+        template<typename Correction>
+        Symbol decode_with_table(Correction &correction, uint64_t filter_code_data) const {
+            uint32_t v = 0;
+            size_t correctionPos = 0;
+            uint64_t corrected_code_data = 0;
+            bool loaded = false;
+            while (!tableNodes[v].leaf) {
+                const TableNode &node = tableNodes[v];
+                if (node.filterLength > TABLE_FILTER_BITS) [[unlikely]] {
+                    uint64_t mask = (uint64_t(1) << node.filterLength) - 1;
+                    bool allOnes = ((filter_code_data >> node.filterOffset) & mask) == mask;
+                    if (allOnes && !loaded) {
+                        corrected_code_data = correction();
+                        loaded = true;
+                    }
+                    uint64_t correctionBits = correctionPos < 64 ? corrected_code_data >> correctionPos : 0;
+                    v = node.children[allOnes ? correctionBits & 1 : 1];
+                    correctionPos += allOnes;
+                    continue;
+                }
+                uint64_t filterWindow = (filter_code_data >> node.filterOffset) & ((1u << TABLE_FILTER_BITS) - 1);
+                auto lookup = [&] {
+                    uint64_t correctionBits = correctionPos < 64 ? corrected_code_data >> correctionPos : 0;
+                    uint64_t window = filterWindow
+                                      | ((correctionBits & ((1u << TABLE_CORRECTION_BITS) - 1)) << TABLE_FILTER_BITS);
+                    return table[node.rowOrSymbol * TABLE_ROW + window];
+                };
+                uint32_t entry = lookup();
+                if ((entry >> 16) > 0 && !loaded) {
+                    corrected_code_data = correction();
+                    loaded = true;
+                    entry = lookup();
+                }
+                v = entry & 0xFFFF;
+                correctionPos += entry >> 16;
+            }
+            return tableNodes[v].rowOrSymbol;
+        }
+
     public:
 
         BitWiseFilterCoding() {
@@ -575,7 +854,9 @@ namespace lsf {
         }
 
         BitWiseFilterCoding(size_t cats, const std::span<Frequency> &f) : coder(cats, f) {
-
+            if constexpr (requires { Coder<Symbol, Frequency>::STATIC_TREE; }) {
+                build_decoding_table(coder.tree, coder.root.index);
+            }
         }
 
         size_t getFilterBits(size_t currentTotal, float p, size_t depth) {
@@ -593,8 +874,17 @@ namespace lsf {
          * a 0 in the filter code is stored in a VLR retrieval structure, a 1 is skipped
          */
         FilterCode encode_once_filter(const std::span<Frequency> &f, Symbol symbol) {
+            FilterDecisions decisions;
+            return encode_once_filter(f, symbol, decisions);
+        }
+
+        /*
+         * same as above but also records the decisions that encode_once_corrected_code needs
+         */
+        FilterCode encode_once_filter(const std::span<Frequency> &f, Symbol symbol, FilterDecisions &decisions) {
             coder.template init<true>(f, symbol);
             FilterCode res{0, 0, 0};
+            decisions = {0, 0, 0, 0};
             size_t depth = 0;
             while (!coder.hasFinished()) {
                 float r1 = coder.getRelProbabilityAndAdvance();
@@ -606,8 +896,16 @@ namespace lsf {
                     res.bitsSet += filterBits;
                 }
                 res.length += filterBits;
+                if (depth >= 8 * sizeof(decisions.bits))
+                    throw std::runtime_error("Code trees deeper than 64 levels are not supported");
+                decisions.bits |= uint64_t(r) << depth;
+                if (filterBits > 0) {
+                    decisions.filtered |= uint64_t(1) << depth;
+                    decisions.filterEnds |= uint16_t(1) << (res.length - 1);
+                }
                 depth++;
             }
+            decisions.depth = depth;
             return res;
         }
 
@@ -636,12 +934,49 @@ namespace lsf {
             return res;
         }
 
+        /*
+         * same as above but replays recorded decisions instead of walking the coder
+         */
+        static CorrectionCode encode_once_corrected_code(const FilterDecisions &decisions, uint64_t filter_code_data) {
+            CorrectionCode res{0, 0};
+            size_t totalFilterBitLength = 0;
+            for (size_t depth = 0; depth < decisions.depth; ++depth) {
+                uint64_t filterBitLength = 0;
+                if ((decisions.filtered >> depth) & 1) {
+                    filterBitLength = std::countr_zero(uint64_t(decisions.filterEnds >> totalFilterBitLength)) + 1;
+                }
+                totalFilterBitLength += filterBitLength;
+                uint64_t filterBits = filter_code_data & ((uint64_t(1) << filterBitLength) - 1);
+                filter_code_data >>= filterBitLength;
+
+                if (filterBits == ((uint64_t(1) << filterBitLength) - 1)) {
+                    res.code |= ((decisions.bits >> depth) & 1) << res.length;
+                    res.length++;
+                }
+            }
+            return res;
+        }
+
         Symbol
         decode_once(const std::span<Frequency> &f, uint64_t corrected_code_data, uint64_t filter_code_data) {
+            return decode_once_lazy(f, [corrected_code_data] { return corrected_code_data; }, filter_code_data);
+        }
+
+        /*
+         * same as above but calls correction() for the correction code only when the walk reaches the first node
+         * whose filter bits are all ones, so keys that need no correction bit skip the correction retrieval
+         */
+        template<typename Correction>
+        Symbol decode_once_lazy(const std::span<Frequency> &f, Correction correction, uint64_t filter_code_data) {
             // the coder has to ensure that at each node the probability of branch 0 is at most 50% (otherwise we would need to swap the filter)
+            if (!tableNodes.empty()) {
+                return decode_with_table(correction, filter_code_data);
+            }
             coder.init(f);
             int depth = 0;
             size_t totalFilterBitLength = 0;
+            uint64_t corrected_code_data = 0;
+            bool loaded = false;
             while (!coder.hasFinished()) {
                 float probability = coder.getRelProbabilityAndAdvance();
                 assert(probability <= 0.5);
@@ -650,6 +985,10 @@ namespace lsf {
                 uint64_t filterBits = filter_code_data & ((uint64_t(1) << filterBitLength) - 1);
                 filter_code_data >>= filterBitLength;
                 if (filterBits == ((uint64_t(1) << filterBitLength) - 1)) {
+                    if (!loaded) {
+                        corrected_code_data = correction();
+                        loaded = true;
+                    }
                     bool nextBit = corrected_code_data & 1;
                     coder.nextBit(nextBit);
                     corrected_code_data >>= 1;
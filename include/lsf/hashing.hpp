@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <immintrin.h>
+
+namespace lsf {
+
+    /**
+     * Hashes a fixed-width key with the splitmix64 finalizer. This is a bijection, so distinct keys never collide,
+     * and it needs no state, so it is reentrant and takes a few cycles per key.
+     */
+    constexpr uint64_t hash_key(uint64_t key) {
+        uint64_t z = key + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    /** Hashes keys[i] into out[i], eight keys per instruction where AVX-512 is available. */
+    inline void hash_keys(std::span<const uint64_t> keys, std::span<uint64_t> out) {
+        size_t i = 0;
+#ifdef __AVX512DQ__
+        const __m512i golden = _mm512_set1_epi64(0x9E3779B97F4A7C15ULL);
+        const __m512i m1 = _mm512_set1_epi64(0xBF58476D1CE4E5B9ULL);
+        const __m512i m2 = _mm512_set1_epi64(0x94D049BB133111EBULL);
+        for (; i + 8 <= keys.size(); i += 8) {
+            __m512i z = _mm512_add_epi64(_mm512_loadu_si512(keys.data() + i), golden);
+            z = _mm512_mullo_epi64(_mm512_xor_si512(z, _mm512_srli_epi64(z, 30)), m1);
+            z = _mm512_mullo_epi64(_mm512_xor_si512(z, _mm512_srli_epi64(z, 27)), m2);
+            _mm512_storeu_si512(out.data() + i, _mm512_xor_si512(z, _mm512_srli_epi64(z, 31)));
+        }
+#endif
+        for (; i < keys.size(); ++i)
+            out[i] = hash_key(keys[i]);
+    }
+}
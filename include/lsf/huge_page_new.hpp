@@ -0,0 +1,135 @@
+#pragma once
+
+/*
+ * Replaces the global operator new and delete, so that large allocations made by a thread while it has a
+ * HugePageScope active are placed on huge pages. This is the only way to reach the retrieval tables, which are
+ * allocated inside the retrieval library. Every replaceable form is covered, including the aligned and nothrow
+ * ones, so no allocation of the library bypasses the scope. Outside of a scope, operator new only reads a
+ * thread-local mode, and operator delete only looks up addresses that are 2 MB aligned. Include it in exactly one
+ * translation unit, storages refuse huge pages otherwise, see require_huge_page_new().
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include "huge_pages.hpp"
+
+namespace lsf::detail {
+    inline void *allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) {
+        // huge page mappings are 2 MB aligned
+        if (alignment <= hugePageBytes) {
+            if (void *memory = allocate_huge(bytes))
+                return memory;
+        }
+        if (bytes == 0)
+            bytes = 1;
+        while (true) {
+            void *memory = nullptr;
+            if (alignment <= alignof(std::max_align_t))
+                memory = std::malloc(bytes);
+            else if (posix_memalign(&memory, alignment, bytes) != 0)
+                memory = nullptr;
+            if (memory)
+                return memory;
+            std::new_handler handler = std::get_new_handler();
+            if (!handler)
+                throw std::bad_alloc();
+            handler();
+        }
+    }
+
+    inline void *allocate_nothrow(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) noexcept {
+        try {
+            return allocate(bytes, alignment);
+        } catch (...) {
+            return nullptr;
+        }
+    }
+
+    inline void deallocate(void *memory) noexcept {
+        if (!deallocate_huge(memory))
+            std::free(memory);
+    }
+
+    [[maybe_unused]] static const bool hugePageNewRegistered = hugePageNewInstalled = true;
+}
+
+void *operator new(std::size_t bytes) {
+    return lsf::detail::allocate(bytes);
+}
+
+void *operator new[](std::size_t bytes) {
+    return lsf::detail::allocate(bytes);
+}
+
+void *operator new(std::size_t bytes, const std::nothrow_t &) noexcept {
+    return lsf::detail::allocate_nothrow(bytes);
+}
+
+void *operator new[](std::size_t bytes, const std::nothrow_t &) noexcept {
+    return lsf::detail::allocate_nothrow(bytes);
+}
+
+void *operator new(std::size_t bytes, std::align_val_t alignment) {
+    return lsf::detail::allocate(bytes, std::size_t(alignment));
+}
+
+void *operator new[](std::size_t bytes, std::align_val_t alignment) {
+    return lsf::detail::allocate(bytes, std::size_t(alignment));
+}
+
+void *operator new(std::size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return lsf::detail::allocate_nothrow(bytes, std::size_t(alignment));
+}
+
+void *operator new[](std::size_t bytes, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return lsf::detail::allocate_nothrow(bytes, std::size_t(alignment));
+}
+
+void operator delete(void *memory) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete[](void *memory, std::size_t) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t &) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t &) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete(void *memory, std::size_t, std::align_val_t) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete[](void *memory, std::size_t, std::align_val_t) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete(void *memory, std::align_val_t, const std::nothrow_t &) noexcept {
+    lsf::detail::deallocate(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t, const std::nothrow_t &) noexcept {
+    lsf::detail::deallocate(memory);
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace lsf {
+
+    /**
+     * Where large allocations of a structure are placed. TRANSPARENT asks for transparent huge pages with madvise,
+     * the EXPLICIT modes take pages from the hugetlbfs pool of the given size, which must be reserved beforehand
+     * (e.g., vm.nr_hugepages). An explicit allocation that cannot be served falls back to transparent huge pages.
+     */
+    enum class HugePageMode : uint8_t {
+        NONE, TRANSPARENT, EXPLICIT_2MB, EXPLICIT_1GB
+    };
+
+    inline HugePageMode parse_huge_page_mode(const std::string &name) {
+        if (name == "none")
+            return HugePageMode::NONE;
+        if (name == "thp")
+            return HugePageMode::TRANSPARENT;
+        if (name == "2mb")
+            return HugePageMode::EXPLICIT_2MB;
+        if (name == "1gb")
+            return HugePageMode::EXPLICIT_1GB;
+        throw std::runtime_error("Unknown huge page mode " + name + ", expected none, thp, 2mb or 1gb");
+    }
+
+    inline std::string to_string(HugePageMode mode) {
+        static constexpr const char *names[] = {"none", "thp", "2mb", "1gb"};
+        return names[size_t(mode)];
+    }
+
+    constexpr size_t hugePageBytes = size_t(2) << 20;
+    constexpr size_t giganticPageBytes = size_t(1) << 30;
+    // smaller allocations span a few pages at most, rounding them up to a huge page would mostly waste memory
+    constexpr size_t hugeAllocationMinBytes = size_t(1) << 20;
+
+    /** A mapping of map_huge_pages(), with the mode it got, which is TRANSPARENT if an explicit one failed. */
+    struct HugePageMapping {
+        void *memory = nullptr;
+        size_t bytes = 0;
+        HugePageMode mode = HugePageMode::NONE;
+    };
+
+    /**
+     * Maps bytes of anonymous memory on huge pages of the given mode, rounded up to the page size. The memory is
+     * nullptr if no huge page mapping was possible. EXPLICIT_1GB maps less than 1 GiB on 2 MB pages instead, as a
+     * whole gigantic page per allocation would drain the pool after a few small tables.
+     */
+    inline HugePageMapping map_huge_pages(size_t bytes, HugePageMode mode) {
+        if (mode == HugePageMode::EXPLICIT_1GB && bytes < giganticPageBytes)
+            mode = HugePageMode::EXPLICIT_2MB;
+        if (mode == HugePageMode::EXPLICIT_2MB || mode == HugePageMode::EXPLICIT_1GB) {
+            const bool gigantic = mode == HugePageMode::EXPLICIT_1GB;
+            const size_t page = gigantic ? giganticPageBytes : hugePageBytes;
+            const int pageFlag = (gigantic ? 30 : 21) << MAP_HUGE_SHIFT;
+            const size_t mappedBytes = (bytes + page - 1) / page * page;
+            void *p = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | pageFlag, -1, 0);
+            if (p != MAP_FAILED)
+                return {p, mappedBytes, mode};
+        }
+        if (mode == HugePageMode::NONE)
+            return {};
+        // transparent huge pages need a 2 MB aligned range, so the mapping is over-allocated and trimmed
+        const size_t mappedBytes = (bytes + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+        void *raw = mmap(nullptr, mappedBytes + hugePageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+        if (raw == MAP_FAILED)
+            return {};
+        auto begin = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = (begin + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+        if (aligned > begin)
+            munmap(raw, aligned - begin);
+        if (hugePageBytes > aligned - begin)
+            munmap(reinterpret_cast<void *>(aligned + mappedBytes), hugePageBytes - (aligned - begin));
+        madvise(reinterpret_cast<void *>(aligned), mappedBytes, MADV_HUGEPAGE);
+        return {reinterpret_cast<void *>(aligned), mappedBytes, HugePageMode::TRANSPARENT};
+    }
+
+    /**
+     * Asks the kernel to back the 2 MB aligned part of existing memory, e.g., a read-only file mapping, with
+     * transparent huge pages. Where MADV_COLLAPSE is available, the pages are collapsed right away instead of
+     * eventually by khugepaged. File mappings need a kernel with read-only THP for file systems.
+     */
+    inline void advise_huge_pages(std::span<const std::byte> memory) {
+        const auto address = reinterpret_cast<uintptr_t>(memory.data());
+        uintptr_t begin = (address + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+        uintptr_t end = (address + memory.size()) / hugePageBytes * hugePageBytes;
+        if (end <= begin)
+            return;
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE);
+#ifdef MADV_COLLAPSE
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_COLLAPSE);
+#endif
+    }
+
+    namespace detail {
+        /*
+         * Allocations served on huge pages, in an open addressing table keyed by address with linear probing, as it
+         * is used from within operator new. Every huge allocation is 2 MB aligned, so freeing other memory only
+         * looks into the table in the rare case that its address is aligned as well.
+         */
+        class HugeAllocations {
+            static constexpr size_t CAPACITY = 4096;
+            static constexpr size_t MAX_LIVE = CAPACITY / 4 * 3;
+
+            std::mutex mutex;
+            std::array<HugePageMapping, CAPACITY> entries;
+            size_t live = 0;
+            std::array<std::atomic<size_t>, 4> liveBytes{};
+
+            static size_t home(const void *memory) {
+                return size_t((reinterpret_cast<uintptr_t>(memory) / hugePageBytes) * 0x9E3779B97F4A7C15ull >> 52);
+            }
+
+        public:
+
+            /** Returns false if the table is full, the mapping then stays with the caller. */
+            bool insert(const HugePageMapping &mapping) {
+                std::lock_guard lock(mutex);
+                if (live == MAX_LIVE)
+                    return false;
+                size_t slot = home(mapping.memory);
+                while (entries[slot].memory)
+                    slot = (slot + 1) % CAPACITY;
+                entries[slot] = mapping;
+                live++;
+                liveBytes[size_t(mapping.mode)] += mapping.bytes;
+                return true;
+            }
+
+            /** Unmaps the allocation at memory and returns its size, 0 if it was not allocated on huge pages. */
+            size_t erase(void *memory) {
+                if (reinterpret_cast<uintptr_t>(memory) % hugePageBytes != 0)
+                    return 0;
+                HugePageMapping mapping;
+                {
+                    std::lock_guard lock(mutex);
+                    size_t slot = home(memory);
+                    while (entries[slot].memory && entries[slot].memory != memory)
+                        slot = (slot + 1) % CAPACITY;
+                    if (!entries[slot].memory)
+                        return 0;
+                    mapping = entries[slot];
+                    // backward shift deletion, so that no later entry of the probe sequence becomes unreachable
+                    for (size_t next = (slot + 1) % CAPACITY; entries[next].memory; next = (next + 1) % CAPACITY) {
+                        size_t nextHome = home(entries[next].memory);
+                        if ((next - nextHome) % CAPACITY >= (next - slot) % CAPACITY) {
+                            entries[slot] = entries[next];
+                            slot = next;
+                        }
+                    }
+                    entries[slot] = {};
+                    live--;
+                    liveBytes[size_t(mapping.mode)] -= mapping.bytes;
+                }
+                munmap(mapping.memory, mapping.bytes);
+                return mapping.bytes;
+            }
+
+            size_t live_bytes(HugePageMode mode) const {
+                return liveBytes[size_t(mode)].load(std::memory_order_relaxed);
+            }
+        };
+
+        // constant initialized, so it is usable from operator new during the static initialization of the program
+        inline constinit HugeAllocations hugeAllocations;
+
+        // the mode of the innermost HugePageScope of the thread
+        inline constinit thread_local HugePageMode scopeMode = HugePageMode::NONE;
+        // the bytes the thread has mapped in allocate_huge() and unmapped in deallocate_huge() so far
+        inline constinit thread_local size_t threadMappedBytes = 0;
+        inline constinit thread_local size_t threadUnmappedBytes = 0;
+
+        // set by huge_page_new.hpp when the program routes operator new through allocate_huge()
+        inline constinit bool hugePageNewInstalled = false;
+    }
+
+    /** Throws if mode asks for huge pages but no translation unit of the program includes huge_page_new.hpp. */
+    inline void require_huge_page_new(HugePageMode mode) {
+        if (mode != HugePageMode::NONE && !detail::hugePageNewInstalled)
+            throw std::runtime_error("Huge pages need huge_page_new.hpp in one translation unit of the program");
+    }
+
+    /**
+     * Sets the huge page mode of the large allocations of the calling thread while it is alive. Other threads are
+     * not affected, so a storage can place just its retrieval tables on huge pages while other work of the process
+     * keeps allocating normally. Takes effect only in programs that include huge_page_new.hpp in one of their
+     * translation units, which routes operator new through allocate_huge(), see require_huge_page_new().
+     */
+    class HugePageScope {
+        HugePageMode previous;
+        size_t startMapped = detail::threadMappedBytes;
+        size_t startUnmapped = detail::threadUnmappedBytes;
+
+    public:
+        explicit HugePageScope(HugePageMode mode) : previous(std::exchange(detail::scopeMode, mode)) {}
+
+        HugePageScope(const HugePageScope &) = delete;
+
+        HugePageScope &operator=(const HugePageScope &) = delete;
+
+        ~HugePageScope() {
+            detail::scopeMode = previous;
+        }
+
+        /**
+         * The bytes of huge pages the thread has mapped since the scope was opened and not unmapped again, i.e.,
+         * what the allocations of the scope still hold if it freed nothing older.
+         */
+        size_t allocated_bytes() const {
+            const size_t mapped = detail::threadMappedBytes - startMapped;
+            const size_t unmapped = detail::threadUnmappedBytes - startUnmapped;
+            return mapped > unmapped ? mapped - unmapped : 0;
+        }
+    };
+
+    /** Allocates on huge pages if a HugePageScope of the thread is active and the allocation is large enough. */
+    inline void *allocate_huge(size_t bytes) {
+        const HugePageMode mode = detail::scopeMode;
+        if (mode == HugePageMode::NONE || bytes < hugeAllocationMinBytes)
+            return nullptr;
+        HugePageMapping mapping = map_huge_pages(bytes, mode);
+        if (!mapping.memory)
+            return nullptr;
+        if (!detail::hugeAllocations.insert(mapping)) {
+            munmap(mapping.memory, mapping.bytes);
+            return nullptr;
+        }
+        detail::threadMappedBytes += mapping.bytes;
+        return mapping.memory;
+    }
+
+    /** Releases memory of allocate_huge(). Returns false if the memory was not allocated on huge pages. */
+    inline bool deallocate_huge(void *memory) {
+        const size_t bytes = memory ? detail::hugeAllocations.erase(memory) : 0;
+        detail::threadUnmappedBytes += bytes;
+        return bytes > 0;
+    }
+
+    /**
+     * Bytes currently allocated by allocate_huge() on pages of the given mode. An explicit mode whose pool was
+     * empty shows up as TRANSPARENT.
+     */
+    inline size_t huge_page_bytes(HugePageMode mode) {
+        return detail::hugeAllocations.live_bytes(mode);
+    }
+
+    /** The mode that the live huge page allocations actually got, "mixed" if the explicit pool ran dry midway. */
+    inline std::string huge_page_mode_in_use() {
+        const size_t transparent = huge_page_bytes(HugePageMode::TRANSPARENT);
+        const size_t explicit2mb = huge_page_bytes(HugePageMode::EXPLICIT_2MB);
+        const size_t explicit1gb = huge_page_bytes(HugePageMode::EXPLICIT_1GB);
+        const int modes = (transparent > 0) + (explicit2mb > 0) + (explicit1gb > 0);
+        if (modes > 1)
+            return "mixed";
+        if (explicit1gb > 0)
+            return to_string(HugePageMode::EXPLICIT_1GB);
+        if (explicit2mb > 0)
+            return to_string(HugePageMode::EXPLICIT_2MB);
+        return to_string(transparent > 0 ? HugePageMode::TRANSPARENT : HugePageMode::NONE);
+    }
+}
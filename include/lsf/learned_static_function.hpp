@@ -1,166 +1,565 @@
 #pragma once
 
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <tuple>
+
 #include "filter_coding.hpp"
 #include "dataset_reader.hpp"
+#include "hashing.hpp"
+#include "huge_pages.hpp"
 #include "model_wrapper.hpp"
+#include "parallel.hpp"
+#include "persistence.hpp"
+#include "mapped_file.hpp"
+#include "spill_buffer.hpp"
+#include "build_stats.hpp"
+#include "partitioned_storage.hpp"
+#include "colocated_storage.hpp"
+#include "retrieval_backend.hpp"
+#include "query_executor.hpp"
+#include "query_profile.hpp"
 
 namespace lsf {
 
 
-    constexpr size_t recDepth = 2;
-    constexpr float slotsPerItem = 0.96;
-    struct BuRRConfig
-            : public ribbon::RConfig<128, 1, ribbon::ThreshMode::twobit, false, true, false, 0, uint64_t> {
-        static constexpr bool kUseVLR = true;
-        static constexpr Index kBucketSize = 128;
-    };
+    constexpr size_t stashBudgetBytes = size_t(1) << 30;
+
+    /** Keys between issuing the prefetches of a query and decoding it, 0 disables prefetching. */
+    constexpr size_t defaultPrefetchDistance = 16;
 
 
-    template<typename Coding>
+    /**
+     * Stores the filter codes and the correction codes of the coding in one retrieval each. The backends default to
+     * BuRR with variable length results, e.g., FixedWidthFilterBackend trades filter space for simpler queries.
+     */
+    template<typename Coding, RetrievalBackend FilterBackend = BuRRVLRBackend,
+            RetrievalBackend CorrectionBackend = BuRRVLRBackend>
     class FilteredLSFStorage {
-        ribbon::ribbon_filter<recDepth, BuRRConfig> correctionVLSF;
-        ribbon::ribbon_filter<recDepth, BuRRConfig> filterVLSF;
+        using FilterRow = typename FilterBackend::Row;
+        using CorrectionRow = typename CorrectionBackend::Row;
+
+        CorrectionBackend correctionRetrieval;
+        FilterBackend filterRetrieval;
         Coding coder;
+        size_t classes;
+        std::vector<float> coder_frequencies;
+        HugePageMode tablePages = HugePageMode::NONE;
+        size_t hugePageTableBytes = 0;
+        size_t stashBudget = stashBudgetBytes;
 
         size_t statistic_bits_input;
     public:
+        // the construction temporaries of one ribbon, as the two are built one after the other
+        static constexpr size_t RIBBON_BUILD_BYTES_PER_KEY =
+                std::max(FilterBackend::BUILD_BYTES_PER_KEY, CorrectionBackend::BUILD_BYTES_PER_KEY);
 
         FilteredLSFStorage() {}
 
+        /**
+         * Places the retrieval tables of later builds and loads on huge pages of the given mode. Only loading a
+         * retrieval runs under the HugePageScope, builds move the finished tables there by reloading them, so the
+         * input rows, coder state and ribbon construction temporaries stay on normal pages.
+         */
+        void set_huge_pages(HugePageMode mode) {
+            require_huge_page_new(mode);
+            tablePages = mode;
+        }
+
+        /** The bytes of huge pages that the retrieval tables got, to check what set_huge_pages() took effect on. */
+        size_t huge_page_bytes() const { return hugePageTableBytes; }
+
+        /** Bounds the memory of the coder decisions stashed during builds, beyond which they spill to disk. */
+        void set_stash_budget(size_t bytes) { stashBudget = bytes; }
+
+        /** Estimated peak memory of build(n) besides the stash: the input rows and the ribbon temporaries. */
+        static size_t build_bytes(size_t n) {
+            return n * (sizeof(FilterRow) + sizeof(CorrectionRow) + RIBBON_BUILD_BYTES_PER_KEY);
+        }
+
+        /** The stash budget with which build(n) keeps all coder decisions in memory. */
+        static size_t stash_bytes(size_t n) {
+            return n * sizeof(FilterDecisions);
+        }
+
         template<typename F>
-        void build(size_t n, size_t classes_count, F get) {
-            statistic_bits_input = 0;
+        BuildStats build(size_t n, size_t classes_count, F get) {
+            return build(n, classes_count, std::span<F>(&get, 1));
+        }
+
+        /*
+         * Builds with one worker thread per getter. Each getter must be safe to call concurrently with the others,
+         * e.g., by owning its model instance. The output does not depend on the number of threads.
+         */
+        template<typename F>
+        BuildStats build(size_t n, size_t classes_count, std::span<F> gets) {
             rocksdb::StopWatchNano timer(true);
-            size_t huffman_bits = 0;
-            size_t filter_bits = 0;
-            using namespace ribbon;
-            IMPORT_RIBBON_CONFIG(BuRRConfig);
-
-            auto [hashCSF, labelCSF, probabilitiesCSF] = get(0);
-            // probabilitiesCSF are the relative frequencies when used as a CSF
-            coder = Coding(classes_count, probabilitiesCSF);
-            size_t maxlenfilter = 0;
-            auto inputFilter = std::make_unique<std::pair<Key, ResultRowVLR>[]>(n);
-            for (size_t i = 0; i < n; ++i) {
-                auto [hash, label, probabilities] = get(i);
-                auto [code, filterLength, bitsSet] = coder.encode_once_filter(probabilities, label);
-                statistic_bits_input += bitsSet;
-                inputFilter[i].first = hash;
-                if (filterLength > maxlenfilter)
-                    maxlenfilter = filterLength;
-                inputFilter[i].second = static_cast<uint64_t>(code) | (uint64_t(1) << filterLength);
-                filter_bits += filterLength;
+
+            BuildStats stats;
+            stats.keys = n;
+            auto [hashCSF, labelCSF, probabilitiesCSF] = gets[0](0);
+            init_coder(classes_count, probabilitiesCSF);
+            const size_t threads = gets.size();
+            std::vector<Coding> coders(threads, coder);
+            std::vector<BuildStats> workerStats(threads);
+
+            // the model is only invoked here, the correction codes are derived from the stashed coder decisions
+            std::vector<SpillBuffer<FilterDecisions>> stashes;
+            for (size_t t = 0; t < threads; ++t)
+                stashes.emplace_back(stashBudget / threads);
+
+            auto inputFilter = std::make_unique<FilterRow[]>(n);
+            auto input = std::make_unique<CorrectionRow[]>(n);
+            parallel_for(n, threads, [&](size_t begin, size_t end, size_t t) {
+                FilterDecisions decisions;
+                for (size_t i = begin; i < end; ++i) {
+                    auto [hash, label, probabilities] = gets[t](i);
+                    auto [code, filterLength, bitsSet] = coders[t].encode_once_filter(probabilities, label, decisions);
+                    stashes[t].push_back(decisions);
+                    workerStats[t].filterBitsSet.add(bitsSet);
+                    workerStats[t].filterLengths.add(filterLength);
+                    inputFilter[i] = FilterBackend::make_row(hash, code, filterLength);
+                    input[i].first = hash;
+                }
+            });
+            for (size_t t = 0; t < threads; ++t) {
+                stats.filterLengths.merge(workerStats[t].filterLengths);
+                stats.filterBitsSet.merge(workerStats[t].filterBitsSet);
+                stats.peakTemporaryBytes += stashes[t].memory_bytes();
+            }
+            stats.peakTemporaryBytes += build_bytes(n);
+            stats.encodeNanos = timer.ElapsedNanos(true);
+
+            filterRetrieval = FilterBackend(n, stats.filterLengths.max());
+            filterRetrieval.AddRange(inputFilter.get(), inputFilter.get() + n, true);
+            filterRetrieval.BackSubst();
+            inputFilter.reset();
+            stats.filterRibbonNanos = timer.ElapsedNanos(true);
+
+            parallel_for(n, threads, [&](size_t begin, size_t end, size_t t) {
+                stashes[t].rewind();
+                for (size_t i = begin; i < end; ++i) {
+                    if (i + defaultPrefetchDistance < end)
+                        filterRetrieval.prefetch(input[i + defaultPrefetchDistance].first);
+                    uint64_t filterVal = filterRetrieval.QueryRetrieval(input[i].first);
+                    auto [code, length] = Coding::encode_once_corrected_code(stashes[t].next(), filterVal);
+                    workerStats[t].correctionLengths.add(length);
+                    input[i] = CorrectionBackend::make_row(input[i].first, code, length);
+                }
+            });
+            for (size_t t = 0; t < threads; ++t) {
+                stats.correctionLengths.merge(workerStats[t].correctionLengths);
+                stats.spilledBytes += stashes[t].spilled_bytes();
             }
+            stats.correctionEncodeNanos = timer.ElapsedNanos(true);
 
-            filterVLSF = ribbon_filter<recDepth, BuRRConfig>(slotsPerItem, 42, maxlenfilter);
-            filterVLSF.AddRange(inputFilter.get(), inputFilter.get() + n, true);
-            filterVLSF.BackSubst();
+            correctionRetrieval = CorrectionBackend(n, stats.correctionLengths.max());
+            correctionRetrieval.AddRange(input.get(), input.get() + n);
+            correctionRetrieval.BackSubst();
+            input.reset();
+            place_tables();
+            stats.correctionRibbonNanos = timer.ElapsedNanos(true);
+            return finish_stats(stats);
+        }
 
-            size_t maxlen = 0;
-            auto input = std::make_unique<std::pair<Key, ResultRowVLR>[]>(n);
+        /*
+         * Builds from a single sequential pass over the keys, for inputs that are not randomly accessible or larger
+         * than the memory. next() yields the (hash, label, probabilities) of the next key, or std::nullopt after the
+         * last one, and the probabilities only need to stay valid until the following call. The encoded rows are
+         * buffered in SpillBuffers, which move them to temporary files beyond the stash budget, and the input rows
+         * of a ribbon are only materialized while that ribbon is built.
+         */
+        template<typename Next>
+        BuildStats build_streaming(size_t classes_count, Next next) {
+            rocksdb::StopWatchNano timer(true);
+
+            auto item = next();
+            if (!item)
+                throw std::runtime_error("Cannot build from an empty stream");
+            init_coder(classes_count, std::get<2>(*item));
+            Coding encoder = coder;
+
+            BuildStats stats;
+            SpillBuffer<StashedKey> stash(stashBudget / 2);
+            std::unique_ptr<FilterRow[]> rows;
+            size_t n = 0;
+            {
+                SpillBuffer<EncodedRow> filterRows(stashBudget / 2);
+                FilterDecisions decisions;
+                for (; item; item = next(), ++n) {
+                    auto &[hash, label, probabilities] = *item;
+                    auto [code, filterLength, bitsSet] = encoder.encode_once_filter(probabilities, label, decisions);
+                    stash.push_back({hash, decisions});
+                    stats.filterBitsSet.add(bitsSet);
+                    stats.filterLengths.add(filterLength);
+                    filterRows.push_back({hash, code, filterLength});
+                }
+                rows = std::make_unique<FilterRow[]>(n);
+                filterRows.rewind();
+                for (size_t i = 0; i < n; ++i) {
+                    auto [hash, code, length] = filterRows.next();
+                    rows[i] = FilterBackend::make_row(hash, code, length);
+                }
+                stats.peakTemporaryBytes = stash.memory_bytes() + filterRows.memory_bytes()
+                                           + n * (std::max(sizeof(FilterRow), sizeof(CorrectionRow))
+                                                  + RIBBON_BUILD_BYTES_PER_KEY);
+                stats.spilledBytes = filterRows.spilled_bytes();
+            }
+            stats.keys = n;
+            stats.encodeNanos = timer.ElapsedNanos(true);
+
+            filterRetrieval = FilterBackend(n, stats.filterLengths.max());
+            filterRetrieval.AddRange(rows.get(), rows.get() + n, true);
+            filterRetrieval.BackSubst();
+            rows.reset();
+            stats.filterRibbonNanos = timer.ElapsedNanos(true);
+
+            // the filter rows are consumed before the correction rows are materialized
+            auto correctionRows = std::make_unique<CorrectionRow[]>(n);
+            stash.rewind();
             for (size_t i = 0; i < n; ++i) {
-                auto [hash, label, probabilities] = get(i);
-                uint64_t filterVal = filterVLSF.QueryRetrieval(hash);
-                auto [code, length] = coder.encode_once_corrected_code(probabilities, label, filterVal);
-                statistic_bits_input += length;
-                input[i].first = hash;
-                if (length > maxlen)
-                    maxlen = length;
-                input[i].second = static_cast<uint64_t>(code) | (uint64_t(1) << length);
-                huffman_bits += length;
+                auto [hash, decisions] = stash.next();
+                uint64_t filterVal = filterRetrieval.QueryRetrieval(hash);
+                auto [code, length] = Coding::encode_once_corrected_code(decisions, filterVal);
+                stats.correctionLengths.add(length);
+                correctionRows[i] = CorrectionBackend::make_row(hash, code, length);
             }
+            stats.spilledBytes += stash.spilled_bytes();
+            stats.correctionEncodeNanos = timer.ElapsedNanos(true);
+
+            correctionRetrieval = CorrectionBackend(n, stats.correctionLengths.max());
+            correctionRetrieval.AddRange(correctionRows.get(), correctionRows.get() + n);
+            correctionRetrieval.BackSubst();
+            correctionRows.reset();
+            place_tables();
+            stats.correctionRibbonNanos = timer.ElapsedNanos(true);
+            return finish_stats(stats);
+        }
 
-            auto nanos = timer.ElapsedNanos(true);
-            std::cout << "Preprocessing time (including filter): " << nanos << " ns ("
-                      << (nanos / static_cast<double>(n)) << " ns/item)\n";
-
-            correctionVLSF = ribbon_filter<recDepth, BuRRConfig>(slotsPerItem, 42, maxlen);
-            correctionVLSF.AddRange(input.get(), input.get() + n);
-            correctionVLSF.BackSubst();
+        /** Mutable decoding state of a query, one per querying thread. */
+        using Scratch = Coding;
 
-            auto nanos2 = timer.ElapsedNanos(true);
-            std::cout << "Ribbon construction time: " << nanos2 << " ns (" << (nanos2 / static_cast<double>(n))
-                      << " ns/item)\n";
-            auto totalnanos = nanos + nanos2;
-            std::cout << "Total construction time: " << totalnanos << " ns ("
-                      << (totalnanos / static_cast<double>(n)) << " ns/item)\n";
-            input.reset();
+        Scratch make_scratch() const {
+            return coder;
+        }
 
-            std::cout << "Max length correction: " << maxlen << "\n";
-            std::cout << "Max length filter: " << maxlenfilter << "\n";
-            const size_t bytesFilter = filterVLSF.Size();
-            const size_t bytes = correctionVLSF.Size();
-            const size_t bytesTotal = bytes + bytesFilter;
-            std::cout << "Ribbon size: " << (bytes * 8) << " bits\n";
-            std::cout << "Filter size: " << (bytesFilter * 8) << " bits\n";
-            std::cout << "Ribbon+Filter size: " << (bytesTotal * 8) << " bits\n";
-            std::cout << "Ribbon bits/example: " << ((bytes * 8) / static_cast<double>(n)) << "\n";
-            std::cout << "Filter bits/example: " << ((bytesFilter * 8) / static_cast<double>(n)) << "\n";
-            std::cout << "Ribbon+Filter bits/example: " << ((bytesTotal * 8) / static_cast<double>(n)) << "\n";
-            std::cout << "Huffman bits: " << huffman_bits << "\n";
-        }
-
-        std::pair<uint64_t, uint64_t> query_storage(uint64_t hash) {
-            uint64_t corrected_code = correctionVLSF.QueryRetrieval(hash);
-            uint64_t filterCode = filterVLSF.QueryRetrieval(hash);
+        std::pair<uint64_t, uint64_t> query_storage(uint64_t hash) const {
+            uint64_t corrected_code = correctionRetrieval.QueryRetrieval(hash);
+            uint64_t filterCode = filterRetrieval.QueryRetrieval(hash);
             return {corrected_code, filterCode};
         }
 
+        /** Starts loading what query_storage(hash) reads from both retrievals, without waiting for it. */
+        void prefetch(uint64_t hash) const {
+            correctionRetrieval.prefetch(hash);
+            filterRetrieval.prefetch(hash);
+        }
+
+        /** Starts loading the filter row that query(hash, ...) reads first, the correction row is read on demand. */
+        void prefetch_filter(uint64_t hash) const {
+            filterRetrieval.prefetch(hash);
+        }
+
         uint64_t query(uint64_t hash, std::span<float> probabilities) {
-            auto [corrected_code, filterCode] = query_storage(hash);
-            return coder.decode_once(probabilities, corrected_code, filterCode);
+            return query(hash, probabilities, coder);
+        }
+
+        /*
+         * Only the filter is queried up front. The correction retrieval is queried once decoding reaches a node that
+         * needs a correction bit, which keys whose filter code resolves every node never do. A profiled query counts
+         * such a late correction lookup as decoding.
+         */
+        uint64_t query(uint64_t hash, std::span<float> probabilities, Scratch &scratch) const {
+            uint64_t filterCode = profile_phase<QueryPhase::RETRIEVAL>([&] {
+                return filterRetrieval.QueryRetrieval(hash);
+            });
+            return profile_phase<QueryPhase::DECODE>([&] {
+                return scratch.decode_once_lazy(probabilities, [&] {
+                    return uint64_t(correctionRetrieval.QueryRetrieval(hash));
+                }, filterCode);
+            });
         }
 
         size_t size_in_bytes() const {
-            return filterVLSF.Size() + correctionVLSF.Size();
+            return filterRetrieval.Size() + correctionRetrieval.Size();
+        }
+
+        void save(BinaryWriter &out) const {
+            out.write_string(get_name());
+            out.write<uint64_t>(classes);
+            out.write<uint64_t>(statistic_bits_input);
+            out.write<uint64_t>(coder_frequencies.size());
+            out.write_bytes(std::as_bytes(std::span(coder_frequencies)));
+            filterRetrieval.save(out);
+            correctionRetrieval.save(out);
+        }
+
+        void load(BinaryReader &in) {
+            if (in.read_string() != get_name())
+                throw std::runtime_error("The LSF file was written with a different storage");
+            classes = in.read<uint64_t>();
+            statistic_bits_input = in.read<uint64_t>();
+            coder_frequencies.resize(in.read<uint64_t>());
+            auto frequencies = in.read_bytes(coder_frequencies.size() * sizeof(float));
+            std::memcpy(coder_frequencies.data(), frequencies.data(), frequencies.size());
+            coder = Coding(classes, std::span(coder_frequencies));
+            // tables of an earlier build are freed first, so that the scope only counts the new ones
+            filterRetrieval = FilterBackend();
+            correctionRetrieval = CorrectionBackend();
+            HugePageScope tables(tablePages);
+            filterRetrieval = FilterBackend::load(in);
+            correctionRetrieval = CorrectionBackend::load(in);
+            hugePageTableBytes = tables.allocated_bytes();
         }
 
         size_t get_statistic_bits_input() const {
             return statistic_bits_input;
         }
 
+        /* The default backends keep the plain name, so that files of earlier builds still load. */
         static const std::string get_name() {
-            return "Filtered-" + Coding::get_name();
+            std::string name = "Filtered-" + Coding::get_name();
+            if constexpr (!std::is_same_v<FilterBackend, BuRRVLRBackend>
+                          || !std::is_same_v<CorrectionBackend, BuRRVLRBackend>)
+                name += "-" + FilterBackend::get_name() + "-" + CorrectionBackend::get_name();
+            return name;
+        }
+
+    private:
+
+        /** A filter code of a streaming build, as the backend rows are not trivially copyable. */
+        struct EncodedRow {
+            uint64_t hash;
+            uint64_t code;
+            size_t length;
+        };
+
+        /** A key of a streaming build between the filter pass and the correction pass. */
+        struct StashedKey {
+            uint64_t hash;
+            FilterDecisions decisions;
+        };
+
+        void init_coder(size_t classes_count, std::span<float> probabilities) {
+            // the probabilities of the first key are the relative frequencies when used as a CSF
+            coder = Coding(classes_count, probabilities);
+            classes = classes_count;
+            coder_frequencies.assign(probabilities.begin(), probabilities.end());
+        }
+
+        /*
+         * Moves the retrieval tables onto huge pages by reloading them from their serialization, as the retrieval
+         * library allocates them in the midst of its construction temporaries.
+         */
+        void place_tables() {
+            hugePageTableBytes = 0;
+            if (tablePages == HugePageMode::NONE)
+                return;
+            std::ostringstream os;
+            BinaryWriter out(os);
+            filterRetrieval.save(out);
+            correctionRetrieval.save(out);
+            const std::string image = std::move(os).str();
+            filterRetrieval = FilterBackend();
+            correctionRetrieval = CorrectionBackend();
+            BinaryReader in(std::as_bytes(std::span(image)));
+            HugePageScope tables(tablePages);
+            filterRetrieval = FilterBackend::load(in);
+            correctionRetrieval = CorrectionBackend::load(in);
+            hugePageTableBytes = tables.allocated_bytes();
+        }
+
+        /* The filter ribbon stores the bits set of the filter codes, the correction ribbon the full codes. */
+        BuildStats finish_stats(BuildStats &stats) {
+            statistic_bits_input = stats.filterBitsSet.total_bits() + stats.correctionLengths.total_bits();
+            stats.filterRibbonBytes = filterRetrieval.Size();
+            stats.correctionRibbonBytes = correctionRetrieval.Size();
+            return stats;
         }
     };
 
     template<typename DataSet, typename Model, typename Storage>
     class LearnedStaticFunction {
-        XXH3_state_t *state;
         Model &model;
         Storage storage;
+        size_t prefetchDistance = defaultPrefetchDistance;
+        bool singleQueryPrefetch = true;
+        BuildStats buildStats;
 
     public:
 
-        LearnedStaticFunction(const DataSet &dataset, Model &model) : model(model) {
-            state = XXH3_createState();
-            assert(state);
-            storage = Storage();
-            storage.build(
-                    dataset.size(),
-                    dataset.classes_count(),
-                    [&](size_t i) {
-                        auto example = dataset.get_example(i);
-                        return std::make_tuple(hash(i, example), dataset.get_label(i), model.invoke(example));
-                    });
+        /*
+         * With threads > 1, construction runs model inference and encoding in parallel. Every additional worker
+         * gets its own copy of the model, as models keep their output in mutable buffers.
+         */
+        LearnedStaticFunction(const DataSet &dataset, Model &model, size_t threads = 1)
+                : LearnedStaticFunction(dataset, model, Storage(), threads) {}
+
+        /** Constructs into a storage that was configured by the caller, e.g., a PartitionedLSFStorage. */
+        LearnedStaticFunction(const DataSet &dataset, Model &model, Storage configured, size_t threads = 1)
+                : model(model), storage(std::move(configured)) {
+            std::vector<Model> workerModels;
+            if constexpr (std::is_copy_constructible_v<Model>) {
+                for (size_t t = 1; t < threads; ++t)
+                    workerModels.emplace_back(model);
+            } else {
+                threads = 1;
+            }
+            std::vector<Getter> gets;
+            gets.push_back({dataset, model});
+            for (auto &m: workerModels)
+                gets.push_back({dataset, m});
+
+            buildStats = storage.build(dataset.size(), dataset.classes_count(), std::span(gets));
+        }
+
+        /**
+         * Constructs from a single pass over [first, last), whose elements destructure into (key, label, features),
+         * e.g., tuples. Each key is evaluated once and its features are not accessed again, so the input can be a
+         * stream that does not fit in memory. Keys must be distinct, as for a dataset, where the key is the index.
+         * Needs a storage with build_streaming(), i.e., not a PartitionedLSFStorage, which routes by random access.
+         */
+        template<std::input_iterator It, std::sentinel_for<It> Sentinel>
+        LearnedStaticFunction(It first, Sentinel last, size_t classes_count, Model &model,
+                              Storage configured = Storage())
+                : model(model), storage(std::move(configured)) {
+            buildStats = storage.build_streaming(classes_count,
+                                    [&]() -> std::optional<std::tuple<uint64_t, uint64_t, std::span<float>>> {
+                if (first == last)
+                    return std::nullopt;
+                auto &&[key, label, features] = *first;
+                auto item = std::make_tuple(hash(key, features), uint64_t(label), model.invoke(features));
+                ++first;
+                return item;
+            });
+        }
+
+        /**
+         * Loads a structure written by save() from a mapped file. The model must be the one used for construction,
+         * e.g., a ModelWrapper created from embedded_model(file.bytes()), and run by the same engine, which is
+         * checked against the file.
+         */
+        LearnedStaticFunction(const MappedFile &file, Model &model, Storage configured = Storage())
+                : LearnedStaticFunction(file.bytes(), model, std::move(configured)) {}
+
+        /**
+         * Loads from an in-memory image of a saved file into a storage configured by the caller, e.g., with huge
+         * pages. The storage copies what it needs, the image can go away.
+         */
+        LearnedStaticFunction(std::span<const std::byte> image, Model &model, Storage configured = Storage())
+                : model(model), storage(std::move(configured)) {
+            BinaryReader in(image);
+            read_header(in, Model::engine_name());
+            storage.load(in);
+        }
+
+        /** Writes the structure to a file, embedding the model if it is backed by a flatbuffer. */
+        void save(const std::string &path) const {
+            std::ofstream os(path, std::ios::binary);
+            if (!os.is_open())
+                throw std::runtime_error("Could not open " + path + " for writing");
+            save(os);
+        }
+
+        void save(std::ostream &os) const {
+            BinaryWriter out(os);
+            if constexpr (requires { model.flatbuffer(); }) {
+                write_header(out, Model::engine_name(), model.flatbuffer());
+            } else {
+                write_header(out, Model::engine_name(), {});
+            }
+            storage.save(out);
+        }
+
+        /**
+         * Per-thread state for concurrent queries: a copy of the model, sharing its weights, and the decoding scratch
+         * of the storage. The const query methods taking a context never modify the structure, so any number of
+         * threads can query it at once, each with its own context.
+         */
+        class QueryContext {
+            friend class LearnedStaticFunction;
+
+            Model model;
+            typename Storage::Scratch scratch;
 
-            std::cout << "Model size: " << model_bytes() * 8 << " bits\n";
-            std::cout << "Total size: " << size_in_bytes() * 8 << " bits\n";
-            std::cout << "Total bits/example: " << (size_in_bytes() * 8 / static_cast<double>(dataset.size())) << "\n";
+            QueryContext(const Model &model, typename Storage::Scratch scratch)
+                    : model(model), scratch(std::move(scratch)) {}
+        };
+
+        QueryContext make_query_context() const {
+            static_assert(std::is_copy_constructible_v<Model>, "Concurrent queries need a copyable model");
+            return QueryContext(model, storage.make_scratch());
         }
 
         std::span<float> query_probabilities(std::span<const float> features) {
             return model.invoke(features);
         }
 
-        auto query_storage(uint64_t key, std::span<const float> features) {
+        auto query_storage(uint64_t key, std::span<const float> features) const {
             return storage.query_storage(hash(key, features));
         }
 
+        /*
+         * The hash does not depend on the model, so the filter row is requested before inference and arrives while
+         * it runs, see set_single_query_prefetch(). The correction row is not, as most keys never read it.
+         *
+         * With LSF_QUERY_PROFILING, the phases of these queries are timed: hashing and inference here, retrieval and
+         * decoding in the storage. See collect_query_profile().
+         */
         uint64_t query(uint64_t key, std::span<const float> features) {
-            return storage.query(hash(key, features), query_probabilities(features));
+            const uint64_t h = profile_phase<QueryPhase::HASH>([&] { return hash(key, features); });
+            if (singleQueryPrefetch)
+                storage.prefetch_filter(h);
+            auto probabilities = profile_phase<QueryPhase::INFERENCE>([&] { return query_probabilities(features); });
+            return storage.query(h, probabilities);
+        }
+
+        uint64_t query(uint64_t key, std::span<const float> features, QueryContext &context) const {
+            const uint64_t h = profile_phase<QueryPhase::HASH>([&] { return hash(key, features); });
+            if (singleQueryPrefetch)
+                storage.prefetch_filter(h);
+            auto probabilities = profile_phase<QueryPhase::INFERENCE>([&] { return context.model.invoke(features); });
+            return storage.query(h, probabilities, context.scratch);
+        }
+
+        /**
+         * The query as a coroutine for an InterleavedQueryExecutor. It suspends once the retrieval rows of both
+         * ribbons are requested, and when resumed runs inference and decoding, by which time the rows have arrived.
+         */
+        QueryTask query_interleaved(uint64_t key, std::span<const float> features, QueryContext &context) const {
+            const uint64_t h = hash(key, features);
+            storage.prefetch(h);
+            co_await std::suspend_always{};
+            co_return storage.query(h, context.model.invoke(features), context.scratch);
+        }
+
+        /**
+         * Answers a group of queries, writing the value of keys[i] to out[i]. The features of all keys are passed
+         * row-major in a single span. If the model has an invoke_batch(), inference runs once for the whole group,
+         * which must give bit for bit the probabilities of invoke(), as the codes were built from those. The
+         * retrieval lookups of the group are pipelined with software prefetches, see set_prefetch_distance().
+         */
+        void query_batch(std::span<const uint64_t> keys, std::span<const float> features, std::span<uint64_t> out) {
+            query_batch_with(model, keys, features, out, [&](uint64_t hash, std::span<float> probabilities) {
+                return storage.query(hash, probabilities);
+            });
         }
 
+        void query_batch(std::span<const uint64_t> keys, std::span<const float> features, std::span<uint64_t> out,
+                         QueryContext &context) const {
+            query_batch_with(context.model, keys, features, out, [&](uint64_t hash, std::span<float> probabilities) {
+                return storage.query(hash, probabilities, context.scratch);
+            });
+        }
+
+        /** Sets how many keys ahead query_batch() prefetches, 0 queries the keys strictly one after another. */
+        void set_prefetch_distance(size_t distance) { prefetchDistance = distance; }
+
+        /** Sets whether single queries request the filter row before inference, which is on by default. */
+        void set_single_query_prefetch(bool enabled) { singleQueryPrefetch = enabled; }
+
         size_t model_bytes() const { return model.model_bytes(); }
 
         size_t storage_bytes() const { return storage.size_in_bytes(); }
@@ -169,13 +568,69 @@ namespace lsf {
 
         size_t get_statistic_bits_input() const { return storage.get_statistic_bits_input(); }
 
+        /** The bytes of huge pages that the retrieval tables got, 0 unless the storage was set up for huge pages. */
+        size_t huge_page_bytes() const { return storage.huge_page_bytes(); }
+
+        /** What the construction took and produced. Empty for a structure that was loaded from a file. */
+        const BuildStats &build_stats() const { return buildStats; }
+
     private:
 
-        uint64_t hash(uint64_t key, std::span<const float> features) {
-            XXH3_64bits_reset(state);
-            XXH3_64bits_update(state, &key, sizeof(size_t));
-            //XXH3_64bits_update(state, features.data(), features.size_bytes());
-            return XXH3_64bits_digest(state);
+        /*
+         * Keys are decoded in order while the retrieval rows of the key prefetchDistance positions ahead are
+         * requested, so the cache misses of a whole window of keys are in flight at once and overlap with inference
+         * and decoding instead of being paid one after another.
+         */
+        template<typename F>
+        void query_batch_with(Model &inference, std::span<const uint64_t> keys, std::span<const float> features,
+                              std::span<uint64_t> out, F queryStorage) const {
+            assert(out.size() >= keys.size());
+            if (keys.empty())
+                return;
+            const size_t n = keys.size();
+            const size_t distance = std::min(prefetchDistance, n);
+            // the hashes are staged in out, which is overwritten with the results key by key
+            hash_keys(keys, out);
+            for (size_t i = 0; i < distance; ++i)
+                storage.prefetch(out[i]);
+            auto prefetchAhead = [&](size_t i) {
+                if (distance > 0 && i + distance < n)
+                    storage.prefetch(out[i + distance]);
+            };
+            size_t features_count = features.size() / n;
+            if constexpr (requires { inference.invoke_batch(features); }) {
+                std::span<float> probabilities = inference.invoke_batch(features);
+                size_t width = probabilities.size() / n;
+                for (size_t i = 0; i < n; ++i) {
+                    prefetchAhead(i);
+                    out[i] = queryStorage(out[i], probabilities.subspan(i * width, width));
+                }
+            } else {
+                for (size_t i = 0; i < n; ++i) {
+                    prefetchAhead(i);
+                    auto example = features.subspan(i * features_count, features_count);
+                    out[i] = queryStorage(out[i], inference.invoke(example));
+                }
+            }
+        }
+
+        /** Yields (hash, label, probabilities) of the i-th key. key_hash(i) lets storages route without inference. */
+        struct Getter {
+            const DataSet &dataset;
+            Model &model;
+
+            uint64_t key_hash(size_t i) const {
+                return hash(i, dataset.get_example(i));
+            }
+
+            auto operator()(size_t i) const {
+                auto example = dataset.get_example(i);
+                return std::make_tuple(hash(i, example), dataset.get_label(i), model.invoke(example));
+            }
+        };
+
+        static uint64_t hash(uint64_t key, std::span<const float> features) {
+            return hash_key(key);
         }
     };
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "huge_pages.hpp"
+
+namespace lsf {
+
+    /** Read-only shared memory mapping of a whole file. Processes mapping the same file share its page cache. */
+    class MappedFile {
+        std::byte *data_ = nullptr;
+        size_t size_ = 0;
+
+    public:
+
+        MappedFile() = default;
+
+        explicit MappedFile(const std::string &path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("Could not open file at " + path);
+            struct stat st{};
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                throw std::runtime_error("Could not stat file at " + path);
+            }
+            size_ = st.st_size;
+            if (size_ > 0) {
+                void *p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED) {
+                    close(fd);
+                    throw std::runtime_error("Could not map file at " + path);
+                }
+                data_ = static_cast<std::byte *>(p);
+            }
+            close(fd);
+        }
+
+        MappedFile(MappedFile &&other) noexcept
+                : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+        MappedFile &operator=(MappedFile &&other) noexcept {
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+            return *this;
+        }
+
+        MappedFile(const MappedFile &) = delete;
+
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        ~MappedFile() {
+            if (data_)
+                munmap(data_, size_);
+        }
+
+        /** Passes an access pattern hint (e.g., MADV_SEQUENTIAL or MADV_RANDOM) for the whole mapping. */
+        void advise(int advice) const {
+            if (data_)
+                madvise(data_, size_, advice);
+        }
+
+        /** Asks for the mapping to be backed by transparent huge pages, see lsf::advise_huge_pages(). */
+        void advise_huge_pages() const {
+            lsf::advise_huge_pages(bytes());
+        }
+
+        std::span<const std::byte> bytes() const { return {data_, size_}; }
+
+        size_t size() const { return size_; }
+    };
+}
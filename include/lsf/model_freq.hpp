@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cmath>
+#include <span>
+#include <string>
+#include <vector>
 
 namespace lsf {
 
@@ -9,7 +12,7 @@ namespace lsf {
         std::vector<float> output;
     public:
 
-        ModelFreq(const std::vector<uint16_t> &trainY, size_t classes_count) {
+        ModelFreq(std::span<const uint16_t> trainY, size_t classes_count) {
             output.resize(classes_count);
             for (auto i: trainY) {
                 output[i] += 1.0f;
@@ -23,6 +26,8 @@ namespace lsf {
 
         size_t model_params_count() const { return output.size(); }
 
+        static std::string engine_name() { return "freq"; }
+
 
         std::span<float> invoke(std::span<const float>) {
             return output;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <string>
 
 namespace lsf {
 
@@ -33,6 +34,8 @@ namespace lsf {
 
         size_t model_params_count() const { return 2 * parameters.size(); }
 
+        static std::string engine_name() { return "gauss"; }
+
         float eval_accuracy(const std::vector<float> &testX, const std::vector<uint16_t> &testY) {
             size_t correct = 0;
             for (size_t i = 0; i < testX.size(); ++i) {
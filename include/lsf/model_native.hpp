@@ -0,0 +1,756 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#include "tensorflow/lite/model_builder.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/schema/schema_utils.h"
+
+namespace lsf {
+
+/**
+ * Runs the dense MLPs exported by train/train.py (Dense + ReLU layers followed by softmax or sigmoid) without the
+ * TFLite interpreter. The weights are read once from the .tflite flatbuffer, dequantizing float16 and int8 weights,
+ * and every layer is a matrix-vector product using AVX-512 or AVX2 where available.
+ *
+ * Every output accumulates its products in input order with fused multiply-adds, and the softmax uses its own
+ * exponential, so the scalar and the vector code paths produce the same bits. The outputs depend only on the
+ * weights and the example, hence construction and queries always agree.
+ *
+ * Full-integer models (the uint8 exports, whose activations are int8) run on integers only, with the arithmetic of
+ * TFLite's int8 kernels: exact int32 dot products using AVX-512 VNNI or AVX2, requantization with fixed-point
+ * multipliers, and TFLite's lookup tables for softmax and sigmoid. They produce TFLite's probabilities.
+ */
+class ModelNativeMLP {
+public:
+    enum class Activation { NONE, RELU };
+    enum class Output { LINEAR, SOFTMAX, SIGMOID };
+
+    static constexpr size_t LANES = 16;
+
+    /** Weights are stored transposed: in_dims rows of out_stride floats, zero padded to a multiple of LANES. */
+    struct DenseLayer {
+        size_t in_dims;
+        size_t out_dims;
+        size_t out_stride;
+        std::vector<float> weights;
+        std::vector<float> bias;
+        Activation activation;
+
+        /** Builds a layer from row-major weights of shape [out_dims][in_dims], as stored by TFLite. */
+        DenseLayer(size_t in_dims, size_t out_dims, std::span<const float> row_major, std::span<const float> biases,
+                   Activation activation)
+                : in_dims(in_dims), out_dims(out_dims), out_stride((out_dims + LANES - 1) / LANES * LANES),
+                  weights(in_dims * out_stride), bias(out_stride), activation(activation) {
+            if (row_major.size() != in_dims * out_dims || (!biases.empty() && biases.size() != out_dims))
+                throw std::runtime_error("Dense layer weights do not match its shape");
+            for (size_t o = 0; o < out_dims; ++o)
+                for (size_t i = 0; i < in_dims; ++i)
+                    weights[i * out_stride + o] = row_major[o * in_dims + i];
+            std::copy(biases.begin(), biases.end(), bias.begin());
+        }
+    };
+
+    struct Quantization {
+        float scale;
+        int32_t zero_point;
+    };
+
+    /**
+     * Layer of a full-integer model. The inputs are int8 values stored offset by 128 as uint8, so that the
+     * weights are stored in groups of 4 inputs: in_groups blocks of out_stride x 4 int8 weights. The offset and the
+     * input zero point are folded into the bias.
+     */
+    struct QuantizedLayer {
+        size_t in_dims;
+        size_t in_groups;
+        size_t out_dims;
+        size_t out_stride;
+        std::vector<int8_t> weights;
+        std::vector<int32_t> bias;
+        std::vector<int32_t> multiplier;
+        std::vector<int32_t> shift;
+        int32_t output_zero_point;
+        int32_t activation_min;
+        int32_t activation_max;
+
+        /** effective_scales holds input scale * weight scale / output scale, per tensor or per output. */
+        QuantizedLayer(size_t in_dims, size_t out_dims, std::span<const int8_t> row_major,
+                       std::span<const int32_t> biases, int32_t input_zero_point, std::span<const double> effective_scales,
+                       int32_t output_zero_point, int32_t activation_min, int32_t activation_max)
+                : in_dims(in_dims), in_groups((in_dims + 3) / 4), out_dims(out_dims),
+                  out_stride((out_dims + LANES - 1) / LANES * LANES), weights(in_groups * out_stride * 4),
+                  bias(out_stride), multiplier(out_dims), shift(out_dims), output_zero_point(output_zero_point),
+                  activation_min(activation_min), activation_max(activation_max) {
+            if (row_major.size() != in_dims * out_dims || (!biases.empty() && biases.size() != out_dims)
+                || (effective_scales.size() != 1 && effective_scales.size() != out_dims))
+                throw std::runtime_error("Quantized layer weights do not match its shape");
+            for (size_t o = 0; o < out_dims; ++o) {
+                int32_t sum = 0;
+                for (size_t i = 0; i < in_dims; ++i) {
+                    int8_t w = row_major[o * in_dims + i];
+                    weights[((i / 4) * out_stride + o) * 4 + i % 4] = w;
+                    sum += w;
+                }
+                bias[o] = (biases.empty() ? 0 : biases[o]) - (input_zero_point + 128) * sum;
+                quantize_multiplier(effective_scales[effective_scales.size() == 1 ? 0 : o], multiplier[o], shift[o]);
+            }
+        }
+    };
+
+private:
+    struct Network {
+        std::vector<DenseLayer> layers;
+        Output output = Output::LINEAR;
+        float beta = 1;
+        size_t bytes = 0;
+
+        bool quantized = false;
+        std::vector<QuantizedLayer> quantized_layers;
+        Quantization input_quantization;
+        Quantization output_quantization;
+        Quantization probability_quantization;
+        std::vector<float> softmax_table;   // exp(-input scale * beta * (255 - i))
+        std::vector<int8_t> logistic_table; // indexed by the int8 logit + 128
+    };
+
+    std::shared_ptr<tflite::FlatBufferModel> model;
+    std::shared_ptr<const Network> network;
+    std::vector<float> hidden[2];
+    std::vector<float> output;
+    std::span<float> output_span;
+    std::vector<uint8_t> quantized_hidden[2];
+    std::vector<int32_t> accumulators;
+    std::vector<int8_t> quantized_output;
+
+public:
+
+    ModelNativeMLP() = default;
+
+    ModelNativeMLP(const std::string &model_path)
+            : ModelNativeMLP(tflite::FlatBufferModel::BuildFromFile(model_path.c_str())) {}
+
+    /** Creates a model from the given flatbuffer, which must outlive it (e.g., a mapped file). */
+    explicit ModelNativeMLP(std::span<const std::byte> flatbuffer)
+            : ModelNativeMLP(tflite::FlatBufferModel::BuildFromBuffer(reinterpret_cast<const char *>(flatbuffer.data()),
+                                                                      flatbuffer.size())) {}
+
+    explicit ModelNativeMLP(std::unique_ptr<tflite::FlatBufferModel> flatbuffer_model)
+            : model(std::move(flatbuffer_model)) {
+        if (!model)
+            throw std::runtime_error("Could not load the model");
+        auto loaded = std::make_shared<Network>(load(model->GetModel()));
+        network = loaded;
+        init_buffers();
+    }
+
+    /** Creates a model from given layers, e.g., for testing. It has no flatbuffer to embed. */
+    ModelNativeMLP(std::vector<DenseLayer> layers, Output output_kind, float beta = 1) {
+        auto built = std::make_shared<Network>();
+        built->layers = std::move(layers);
+        built->output = output_kind;
+        built->beta = beta;
+        for (auto &layer: built->layers)
+            built->bytes += sizeof(float) * (layer.in_dims + 1) * layer.out_dims;
+        network = built;
+        init_buffers();
+    }
+
+    /** Creates a model with its own buffers that shares the weights of the given one. */
+    ModelNativeMLP(const ModelNativeMLP &other) : model(other.model), network(other.network) {
+        init_buffers();
+    }
+
+    ModelNativeMLP(ModelNativeMLP &&) = default;
+
+    ModelNativeMLP &operator=(ModelNativeMLP &&) = default;
+
+    size_t model_bytes() const { return network->bytes; }
+
+    /** Identifies the engine in saved LSFs, as its outputs are close to those of TFLite but not bit-identical. */
+    static std::string engine_name() { return "native"; }
+
+    /** The serialized model, as loaded from its file or buffer. Empty for models created from layers. */
+    std::span<const std::byte> flatbuffer() const {
+        if (!model)
+            return {};
+        auto *allocation = model->allocation();
+        return {static_cast<const std::byte *>(allocation->base()), allocation->bytes()};
+    }
+
+    size_t output_width() const { return output_span.size(); }
+
+    size_t input_width() const {
+        return network->quantized ? network->quantized_layers.front().in_dims : network->layers.front().in_dims;
+    }
+
+    std::span<float> invoke(std::span<const float> example) {
+        if (example.size() != input_width())
+            throw std::runtime_error("The model expects " + std::to_string(input_width()) + " features, got "
+                                     + std::to_string(example.size()));
+        if (network->quantized)
+            return invoke_quantized(example);
+        const auto &layers = network->layers;
+        const float *x = example.data();
+        for (size_t l = 0; l + 1 < layers.size(); ++l) {
+            float *y = hidden[l % 2].data();
+            dense(layers[l], x, y);
+            x = y;
+        }
+        float *logits = output.data();
+        dense(layers.back(), x, logits);
+
+        size_t n = layers.back().out_dims;
+        switch (network->output) {
+            case Output::SOFTMAX:
+                softmax(logits, n, network->beta);
+                break;
+            case Output::SIGMOID:
+                for (size_t i = 0; i < n; ++i)
+                    logits[i] = 1.0f / (1.0f + exp(-logits[i]));
+                break;
+            case Output::LINEAR:
+                break;
+        }
+        if (n == 1) {
+            output_span[1] = output_span[0];
+            output_span[0] = 1 - output_span[0];
+        }
+        return output_span;
+    }
+
+private:
+
+    std::span<float> invoke_quantized(std::span<const float> example) {
+        const Network &net = *network;
+        uint8_t *x = quantized_hidden[0].data();
+        for (size_t i = 0; i < example.size(); ++i)
+            x[i] = uint8_t(quantize(example[i], net.input_quantization) + 128);
+        const auto &layers = net.quantized_layers;
+        for (size_t l = 0; l < layers.size(); ++l) {
+            const QuantizedLayer &layer = layers[l];
+            dense(layer, x, accumulators.data());
+            uint8_t *y = quantized_hidden[(l + 1) % 2].data();
+            for (size_t o = 0; o < layer.out_dims; ++o) {
+                int32_t value = multiply_by_quantized_multiplier(accumulators[o] + layer.bias[o], layer.multiplier[o],
+                                                                 layer.shift[o]) + layer.output_zero_point;
+                y[o] = uint8_t(std::clamp(value, layer.activation_min, layer.activation_max) + 128);
+            }
+            x = y;
+        }
+
+        size_t n = layers.back().out_dims;
+        int8_t *q = quantized_output.data();
+        for (size_t i = 0; i < n; ++i)
+            q[i] = int8_t(int32_t(x[i]) - 128);
+        switch (net.output) {
+            case Output::SOFTMAX:
+                softmax(q, n, net.softmax_table, net.probability_quantization);
+                break;
+            case Output::SIGMOID:
+                for (size_t i = 0; i < n; ++i)
+                    q[i] = net.logistic_table[int32_t(q[i]) + 128];
+                break;
+            case Output::LINEAR:
+                break;
+        }
+        const Quantization &out = net.output_quantization;
+        for (size_t i = 0; i < n; ++i)
+            output[i] = float(double(out.scale) * (int32_t(q[i]) - out.zero_point));
+        if (n == 1) {
+            output_span[1] = output_span[0];
+            output_span[0] = 1 - output_span[0];
+        }
+        return output_span;
+    }
+
+    void init_buffers() {
+        if (network->quantized) {
+            const auto &layers = network->quantized_layers;
+            if (layers.empty())
+                throw std::runtime_error("The model has no dense layers");
+            size_t width = 0;
+            for (size_t l = 0; l < layers.size(); ++l) {
+                if (l > 0 && layers[l].in_dims != layers[l - 1].out_dims)
+                    throw std::runtime_error("Consecutive dense layers do not match");
+                width = std::max({width, layers[l].in_groups * 4, layers[l].out_stride});
+            }
+            quantized_hidden[0].assign(width, 0);
+            quantized_hidden[1].assign(width, 0);
+            accumulators.assign(width, 0);
+            quantized_output.assign(width, 0);
+            output.assign(std::max(width, LANES), 0);
+            output_span = std::span(output.data(), std::max<size_t>(2, layers.back().out_dims));
+            return;
+        }
+        const auto &layers = network->layers;
+        if (layers.empty())
+            throw std::runtime_error("The model has no dense layers");
+        size_t width = 0;
+        for (size_t l = 0; l < layers.size(); ++l) {
+            if (l > 0 && layers[l].in_dims != layers[l - 1].out_dims)
+                throw std::runtime_error("Consecutive dense layers do not match");
+            width = std::max(width, layers[l].out_stride);
+        }
+        hidden[0].assign(width, 0);
+        hidden[1].assign(width, 0);
+        output.assign(std::max(width, LANES), 0);
+        output_span = std::span(output.data(), std::max<size_t>(2, layers.back().out_dims));
+    }
+
+    static float half_to_float(uint16_t h) {
+        uint32_t sign = uint32_t(h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1F;
+        uint32_t mantissa = h & 0x3FF;
+        if (exponent == 0x1F)
+            return std::bit_cast<float>(sign | 0x7F800000 | (mantissa << 13));
+        if (exponent == 0) {
+            // subnormal halves are normal floats
+            float value = std::ldexp(float(mantissa), -24);
+            return sign ? -value : value;
+        }
+        return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+    }
+
+    static Network load(const tflite::Model *flatbuffer) {
+        using namespace tflite;
+        if (!flatbuffer || !flatbuffer->subgraphs() || flatbuffer->subgraphs()->size() != 1)
+            throw std::runtime_error("Expected a model with a single subgraph");
+        const SubGraph *graph = flatbuffer->subgraphs()->Get(0);
+        const auto *tensors = graph->tensors();
+        Network net;
+        std::vector<std::vector<float>> dequantized(tensors->size());
+        std::vector<bool> counted(tensors->size());
+
+        // bytes of a constant tensor
+        auto raw_constant = [&](int index) -> std::span<const uint8_t> {
+            const auto *data = flatbuffer->buffers()->Get(tensors->Get(index)->buffer())->data();
+            if (!data || data->size() == 0)
+                throw std::runtime_error("Expected a constant tensor");
+            if (!counted[index])
+                net.bytes += data->size();
+            counted[index] = true;
+            return {data->data(), data->size()};
+        };
+
+        auto quantization_of = [&](int index, size_t channel = 0) -> Quantization {
+            const auto *quantization = tensors->Get(index)->quantization();
+            if (!quantization || !quantization->scale() || quantization->scale()->size() <= channel)
+                throw std::runtime_error("Missing quantization parameters");
+            const auto *zero_points = quantization->zero_point();
+            int64_t zero_point = zero_points && zero_points->size() > channel ? zero_points->Get(channel) : 0;
+            return {quantization->scale()->Get(channel), int32_t(zero_point)};
+        };
+
+        // float values of a constant tensor
+        auto constant = [&](int index) -> std::vector<float> {
+            if (!dequantized[index].empty())
+                return dequantized[index];
+            std::span<const uint8_t> raw = raw_constant(index);
+            std::vector<float> values;
+            switch (tensors->Get(index)->type()) {
+                case TensorType_FLOAT32:
+                    values.resize(raw.size() / sizeof(float));
+                    std::memcpy(values.data(), raw.data(), values.size() * sizeof(float));
+                    break;
+                case TensorType_FLOAT16:
+                    values.resize(raw.size() / sizeof(uint16_t));
+                    for (size_t i = 0; i < values.size(); ++i) {
+                        uint16_t h;
+                        std::memcpy(&h, raw.data() + i * sizeof(h), sizeof(h));
+                        values[i] = half_to_float(h);
+                    }
+                    break;
+                case TensorType_INT8: {
+                    // per-tensor or per output channel, which is the leading dimension of dense weights
+                    size_t channels = tensors->Get(index)->quantization()->scale()->size();
+                    size_t channel_size = raw.size() / channels;
+                    values.resize(raw.size());
+                    for (size_t i = 0; i < values.size(); ++i) {
+                        Quantization q = quantization_of(index, i / channel_size);
+                        values[i] = q.scale * float(int8_t(raw[i]) - q.zero_point);
+                    }
+                    break;
+                }
+                default:
+                    throw std::runtime_error("Unsupported constant tensor type");
+            }
+            return values;
+        };
+
+        int current = graph->inputs()->Get(0);
+        if (tensors->Get(current)->type() != TensorType_FLOAT32)
+            throw std::runtime_error("Expected a float input");
+        // after softmax or sigmoid, only the final DEQUANTIZE of a full-integer model may follow
+        bool finished = false;
+        bool done = false;
+        for (const Operator *op: *graph->operators()) {
+            BuiltinOperator code = GetBuiltinCode(flatbuffer->operator_codes()->Get(op->opcode_index()));
+            int input = op->inputs()->Get(0);
+            int result = op->outputs()->Get(0);
+            if (code == BuiltinOperator_DEQUANTIZE && input != current) {
+                dequantized[result] = constant(input);
+                continue;
+            }
+            if (input != current || done || (finished && !(net.quantized && code == BuiltinOperator_DEQUANTIZE)))
+                throw std::runtime_error(std::string("Unsupported graph structure at ") + EnumNameBuiltinOperator(code));
+            switch (code) {
+                case BuiltinOperator_RESHAPE:
+                    break;
+                case BuiltinOperator_QUANTIZE:
+                    if (net.quantized || !net.layers.empty() || tensors->Get(result)->type() != TensorType_INT8)
+                        throw std::runtime_error("Unsupported quantization of the input");
+                    net.quantized = true;
+                    net.input_quantization = quantization_of(result);
+                    break;
+                case BuiltinOperator_DEQUANTIZE:
+                    if (!net.quantized)
+                        throw std::runtime_error("Unexpected dequantization");
+                    net.output_quantization = quantization_of(input);
+                    done = true;
+                    break;
+                case BuiltinOperator_FULLY_CONNECTED: {
+                    const auto *options = op->builtin_options_as_FullyConnectedOptions();
+                    Activation activation = Activation::NONE;
+                    if (options && options->fused_activation_function() == ActivationFunctionType_RELU)
+                        activation = Activation::RELU;
+                    else if (options && options->fused_activation_function() != ActivationFunctionType_NONE)
+                        throw std::runtime_error("Unsupported fused activation");
+                    int weights_index = op->inputs()->Get(1);
+                    int bias_index = op->inputs()->size() > 2 ? op->inputs()->Get(2) : -1;
+                    const auto *shape = tensors->Get(weights_index)->shape();
+                    size_t out_dims = shape->Get(0);
+                    size_t in_dims = shape->Get(shape->size() - 1);
+                    if (!net.quantized) {
+                        std::vector<float> bias;
+                        if (bias_index >= 0)
+                            bias = constant(bias_index);
+                        net.layers.emplace_back(in_dims, out_dims, constant(weights_index), bias, activation);
+                        break;
+                    }
+                    if (tensors->Get(weights_index)->type() != TensorType_INT8)
+                        throw std::runtime_error("Expected int8 weights");
+                    auto weights = raw_constant(weights_index);
+                    std::vector<int32_t> bias;
+                    if (bias_index >= 0) {
+                        auto raw = raw_constant(bias_index);
+                        bias.resize(raw.size() / sizeof(int32_t));
+                        std::memcpy(bias.data(), raw.data(), bias.size() * sizeof(int32_t));
+                    }
+                    Quantization in = quantization_of(input);
+                    Quantization out = quantization_of(result);
+                    std::vector<double> scales(tensors->Get(weights_index)->quantization()->scale()->size());
+                    for (size_t c = 0; c < scales.size(); ++c) {
+                        Quantization w = quantization_of(weights_index, c);
+                        if (w.zero_point != 0)
+                            throw std::runtime_error("Expected symmetric int8 weights");
+                        scales[c] = double(in.scale) * double(w.scale) / double(out.scale);
+                    }
+                    int32_t activation_min = activation == Activation::RELU ? std::max(-128, out.zero_point) : -128;
+                    net.quantized_layers.emplace_back(
+                            in_dims, out_dims, std::span(reinterpret_cast<const int8_t *>(weights.data()), weights.size()),
+                            bias, in.zero_point, scales, out.zero_point, activation_min, 127);
+                    break;
+                }
+                case BuiltinOperator_SOFTMAX: {
+                    const auto *options = op->builtin_options_as_SoftmaxOptions();
+                    net.output = Output::SOFTMAX;
+                    net.beta = options ? options->beta() : 1.0f;
+                    finished = true;
+                    if (net.quantized) {
+                        // as TFLite's PopulateSoftmaxLookupTable
+                        const float scale = -quantization_of(input).scale * net.beta;
+                        net.softmax_table.resize(256);
+                        for (int32_t value = 0; value <= 255; ++value)
+                            net.softmax_table[255 - value] = std::exp(scale * float(value));
+                        net.probability_quantization = quantization_of(result);
+                    }
+                    break;
+                }
+                case BuiltinOperator_LOGISTIC:
+                    net.output = Output::SIGMOID;
+                    finished = true;
+                    if (net.quantized) {
+                        // as TFLite's LUTPopulate
+                        Quantization in = quantization_of(input);
+                        Quantization out = quantization_of(result);
+                        const float inverse_scale = 1 / out.scale;
+                        net.logistic_table.resize(256);
+                        for (int32_t value = -128; value <= 127; ++value) {
+                            float dequantized_value = in.scale * float(value - in.zero_point);
+                            float transformed = 1.0f / (1.0f + std::exp(-dequantized_value));
+                            int32_t quantized = int32_t(std::round(transformed * inverse_scale) + float(out.zero_point));
+                            net.logistic_table[value + 128] = int8_t(std::clamp(quantized, -128, 127));
+                        }
+                    }
+                    break;
+                default:
+                    throw std::runtime_error(std::string("Unsupported operator ") + EnumNameBuiltinOperator(code));
+            }
+            current = result;
+        }
+        if (current != graph->outputs()->Get(0) || (net.quantized && !done))
+            throw std::runtime_error("The model output is not produced by the dense layers");
+        return net;
+    }
+
+    /* TFLite's QuantizeMultiplier: multiplier = q * 2^shift with q a Q31 fixed-point number in [0.5, 1) */
+    static void quantize_multiplier(double real_multiplier, int32_t &quantized_multiplier, int32_t &shift) {
+        if (real_multiplier == 0.) {
+            quantized_multiplier = 0;
+            shift = 0;
+            return;
+        }
+        int exponent;
+        const double q = std::frexp(real_multiplier, &exponent);
+        auto q_fixed = static_cast<int64_t>(std::round(q * double(int64_t(1) << 31)));
+        if (q_fixed == (int64_t(1) << 31)) {
+            q_fixed /= 2;
+            ++exponent;
+        }
+        if (exponent < -31) {
+            exponent = 0;
+            q_fixed = 0;
+        }
+        quantized_multiplier = int32_t(q_fixed);
+        shift = exponent;
+    }
+
+    /* TFLite's MultiplyByQuantizedMultiplier, i.e., gemmlowp's rounding doubling high multiplication and shift */
+    static int32_t multiply_by_quantized_multiplier(int32_t x, int32_t quantized_multiplier, int32_t shift) {
+        int32_t left_shift = shift > 0 ? shift : 0;
+        int32_t right_shift = shift > 0 ? 0 : -shift;
+        int32_t a = int32_t(uint32_t(x) << left_shift);
+        int32_t high;
+        if (a == std::numeric_limits<int32_t>::min() && quantized_multiplier == std::numeric_limits<int32_t>::min()) {
+            high = std::numeric_limits<int32_t>::max();
+        } else {
+            int64_t ab = int64_t(a) * int64_t(quantized_multiplier);
+            int32_t nudge = ab >= 0 ? (1 << 30) : (1 - (1 << 30));
+            high = int32_t((ab + nudge) / (int64_t(1) << 31));
+        }
+        const int32_t mask = int32_t((int64_t(1) << right_shift) - 1);
+        const int32_t remainder = high & mask;
+        const int32_t threshold = (mask >> 1) + (high < 0 ? 1 : 0);
+        return (high >> right_shift) + (remainder > threshold ? 1 : 0);
+    }
+
+    static int32_t quantize(float value, const Quantization &quantization) {
+        int32_t q = int32_t(std::round(value / quantization.scale)) + quantization.zero_point;
+        return std::clamp(q, -128, 127);
+    }
+
+    /* TFLite's optimized int8 softmax with its float lookup table, in place on the n quantized logits */
+    static void softmax(int8_t *logits, size_t n, const std::vector<float> &table, const Quantization &out) {
+        int32_t max = -128;
+        for (size_t i = 0; i < n; ++i)
+            max = std::max<int32_t>(max, logits[i]);
+        const float *table_offset = table.data() + 255 - max;
+        float sum = 0;
+        for (size_t i = 0; i < n; ++i)
+            sum += table_offset[logits[i]];
+        const float inverse = 1.0f / (sum * out.scale);
+        for (size_t i = 0; i < n; ++i) {
+            int32_t q = int32_t(std::round(table_offset[logits[i]] * inverse)) + out.zero_point;
+            logits[i] = int8_t(std::clamp(q, -128, 127));
+        }
+    }
+
+    /* exact int32 dot products sum_i w[o][i] * (x[i] + 128) for all out_stride outputs */
+    static void dense(const QuantizedLayer &layer, const uint8_t *x, int32_t *acc) {
+        const size_t stride = layer.out_stride;
+        const int8_t *w = layer.weights.data();
+        size_t o = 0;
+#if defined(__AVX512F__) && defined(__AVX512VNNI__)
+        for (; o < stride; o += LANES) {
+            __m512i sum = _mm512_setzero_si512();
+            for (size_t g = 0; g < layer.in_groups; ++g) {
+                int32_t x4;
+                std::memcpy(&x4, x + 4 * g, sizeof(x4));
+                sum = _mm512_dpbusd_epi32(sum, _mm512_set1_epi32(x4), _mm512_loadu_si512(w + (g * stride + o) * 4));
+            }
+            _mm512_storeu_si512(acc + o, sum);
+        }
+#elif defined(__AVX2__)
+        // the products are widened to int16 and summed pairwise with vpmaddwd, which unlike vpmaddubsw cannot saturate
+        for (; o < stride; o += 8) {
+            __m256i low = _mm256_setzero_si256();  // outputs o..o+3, two partial sums each
+            __m256i high = _mm256_setzero_si256(); // outputs o+4..o+7
+            for (size_t g = 0; g < layer.in_groups; ++g) {
+                int32_t x4;
+                std::memcpy(&x4, x + 4 * g, sizeof(x4));
+                __m256i xs = _mm256_cvtepu8_epi16(_mm_set1_epi32(x4));
+                const int8_t *wg = w + (g * stride + o) * 4;
+                __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(wg)));
+                __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(wg + 16)));
+                low = _mm256_add_epi32(low, _mm256_madd_epi16(w0, xs));
+                high = _mm256_add_epi32(high, _mm256_madd_epi16(w1, xs));
+            }
+            // hadd yields outputs 0, 1, 4, 5 | 2, 3, 6, 7
+            __m256i sum = _mm256_permute4x64_epi64(_mm256_hadd_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + o), sum);
+        }
+#endif
+        for (; o < stride; ++o) {
+            int32_t sum = 0;
+            for (size_t g = 0; g < layer.in_groups; ++g)
+                for (size_t k = 0; k < 4; ++k)
+                    sum += int32_t(w[(g * stride + o) * 4 + k]) * int32_t(x[4 * g + k]);
+            acc[o] = sum;
+        }
+    }
+
+    /* y = activation(W x + b) for all out_stride outputs, each accumulated in input order */
+    static void dense(const DenseLayer &layer, const float *x, float *y) {
+        const size_t stride = layer.out_stride;
+        const float *w = layer.weights.data();
+        const float *b = layer.bias.data();
+        const bool relu = layer.activation == Activation::RELU;
+        size_t o = 0;
+#if defined(__AVX512F__)
+        for (; o + 2 * LANES <= stride; o += 2 * LANES) {
+            __m512 acc0 = _mm512_loadu_ps(b + o);
+            __m512 acc1 = _mm512_loadu_ps(b + o + LANES);
+            for (size_t i = 0; i < layer.in_dims; ++i) {
+                __m512 xi = _mm512_set1_ps(x[i]);
+                acc0 = _mm512_fmadd_ps(xi, _mm512_loadu_ps(w + i * stride + o), acc0);
+                acc1 = _mm512_fmadd_ps(xi, _mm512_loadu_ps(w + i * stride + o + LANES), acc1);
+            }
+            if (relu) {
+                acc0 = _mm512_max_ps(acc0, _mm512_setzero_ps());
+                acc1 = _mm512_max_ps(acc1, _mm512_setzero_ps());
+            }
+            _mm512_storeu_ps(y + o, acc0);
+            _mm512_storeu_ps(y + o + LANES, acc1);
+        }
+        for (; o < stride; o += LANES) {
+            __m512 acc = _mm512_loadu_ps(b + o);
+            for (size_t i = 0; i < layer.in_dims; ++i)
+                acc = _mm512_fmadd_ps(_mm512_set1_ps(x[i]), _mm512_loadu_ps(w + i * stride + o), acc);
+            if (relu)
+                acc = _mm512_max_ps(acc, _mm512_setzero_ps());
+            _mm512_storeu_ps(y + o, acc);
+        }
+#elif defined(__AVX2__) && defined(__FMA__)
+        for (; o < stride; o += LANES) {
+            __m256 acc0 = _mm256_loadu_ps(b + o);
+            __m256 acc1 = _mm256_loadu_ps(b + o + 8);
+            for (size_t i = 0; i < layer.in_dims; ++i) {
+                __m256 xi = _mm256_set1_ps(x[i]);
+                acc0 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(w + i * stride + o), acc0);
+                acc1 = _mm256_fmadd_ps(xi, _mm256_loadu_ps(w + i * stride + o + 8), acc1);
+            }
+            if (relu) {
+                acc0 = _mm256_max_ps(acc0, _mm256_setzero_ps());
+                acc1 = _mm256_max_ps(acc1, _mm256_setzero_ps());
+            }
+            _mm256_storeu_ps(y + o, acc0);
+            _mm256_storeu_ps(y + o + 8, acc1);
+        }
+#endif
+        for (; o < stride; o += LANES) {
+            float acc[LANES];
+            std::copy(b + o, b + o + LANES, acc);
+            for (size_t i = 0; i < layer.in_dims; ++i)
+                for (size_t j = 0; j < LANES; ++j)
+                    acc[j] = std::fma(x[i], w[i * stride + o + j], acc[j]);
+            for (size_t j = 0; j < LANES; ++j)
+                y[o + j] = relu ? std::max(acc[j], 0.0f) : acc[j];
+        }
+    }
+
+    /*
+     * Cephes-style exp: 2^n * p(r) with n = round(x / ln 2) and a degree 7 polynomial in the remainder r.
+     * The vector versions below perform exactly the same operations lane by lane.
+     */
+    static constexpr float EXP_MIN = -87.3365447505f;
+    static constexpr float EXP_MAX = 88.3762626647f;
+    static constexpr float LOG2E = 1.44269504089f;
+    static constexpr float LN2_HI = 0.693359375f;
+    static constexpr float LN2_LO = -2.12194440e-4f;
+    static constexpr float EXP_P[6] = {1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f, 4.1665795894e-2f,
+                                       1.6666665459e-1f, 5.0000001201e-1f};
+
+    static float exp(float x) {
+        x = std::min(std::max(x, EXP_MIN), EXP_MAX);
+        float n = std::nearbyint(x * LOG2E);
+        float r = std::fma(n, -LN2_HI, x);
+        r = std::fma(n, -LN2_LO, r);
+        float p = EXP_P[0];
+        for (size_t k = 1; k < 6; ++k)
+            p = std::fma(p, r, EXP_P[k]);
+        p = std::fma(p, r * r, r) + 1.0f;
+        return p * std::bit_cast<float>((int32_t(n) + 127) << 23);
+    }
+
+#if defined(__AVX512F__)
+    static __m512 exp(__m512 x) {
+        x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_MIN)), _mm512_set1_ps(EXP_MAX));
+        __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(LOG2E)),
+                                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m512 r = _mm512_fmadd_ps(n, _mm512_set1_ps(-LN2_HI), x);
+        r = _mm512_fmadd_ps(n, _mm512_set1_ps(-LN2_LO), r);
+        __m512 p = _mm512_set1_ps(EXP_P[0]);
+        for (size_t k = 1; k < 6; ++k)
+            p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P[k]));
+        p = _mm512_add_ps(_mm512_fmadd_ps(p, _mm512_mul_ps(r, r), r), _mm512_set1_ps(1.0f));
+        __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+        return _mm512_mul_ps(p, _mm512_castsi512_ps(e));
+    }
+#elif defined(__AVX2__) && defined(__FMA__)
+    static __m256 exp(__m256 x) {
+        x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_MIN)), _mm256_set1_ps(EXP_MAX));
+        __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m256 r = _mm256_fmadd_ps(n, _mm256_set1_ps(-LN2_HI), x);
+        r = _mm256_fmadd_ps(n, _mm256_set1_ps(-LN2_LO), r);
+        __m256 p = _mm256_set1_ps(EXP_P[0]);
+        for (size_t k = 1; k < 6; ++k)
+            p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P[k]));
+        p = _mm256_add_ps(_mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r), _mm256_set1_ps(1.0f));
+        __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+    }
+#endif
+
+    /* In-place softmax of the first n logits. The logits buffer is padded to a multiple of LANES. */
+    static void softmax(float *logits, size_t n, float beta) {
+        float max = logits[0];
+        for (size_t i = 1; i < n; ++i)
+            max = std::max(max, logits[i]);
+        size_t i = 0;
+#if defined(__AVX512F__)
+        for (; i < n; i += LANES) {
+            __m512 v = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(logits + i), _mm512_set1_ps(max)),
+                                     _mm512_set1_ps(beta));
+            _mm512_storeu_ps(logits + i, exp(v));
+        }
+#elif defined(__AVX2__) && defined(__FMA__)
+        for (; i < n; i += 8) {
+            __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(logits + i), _mm256_set1_ps(max)),
+                                     _mm256_set1_ps(beta));
+            _mm256_storeu_ps(logits + i, exp(v));
+        }
+#endif
+        for (; i < n; ++i)
+            logits[i] = exp((logits[i] - max) * beta);
+        // the normalization is the same scalar code in all builds
+        float sum = 0;
+        for (size_t k = 0; k < n; ++k)
+            sum += logits[k];
+        float inverse = 1.0f / sum;
+        for (size_t k = 0; k < n; ++k)
+            logits[k] *= inverse;
+    }
+};
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <memory>
+#include <span>
+#include <string>
 #include "tensorflow/lite/core/interpreter_builder.h"
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/kernels/register.h"
@@ -9,7 +12,8 @@
 namespace lsf {
 
 class ModelWrapper {
-    std::unique_ptr<tflite::FlatBufferModel> model;
+    std::shared_ptr<tflite::FlatBufferModel> model;
+    tflite::MutableOpResolver resolver;
     std::unique_ptr<tflite::Interpreter> interpreter;
     size_t input_dims;
     size_t output_dims;
@@ -21,11 +25,19 @@ public:
 
     ModelWrapper() = default;
 
-    ModelWrapper(const std::string &model_path) {
+    ModelWrapper(const std::string &model_path)
+            : ModelWrapper(tflite::FlatBufferModel::BuildFromFile(model_path.c_str())) {}
+
+    /** Creates a model that runs directly on the given flatbuffer, which must outlive it (e.g., a mapped file). */
+    explicit ModelWrapper(std::span<const std::byte> flatbuffer)
+            : ModelWrapper(tflite::FlatBufferModel::BuildFromBuffer(reinterpret_cast<const char *>(flatbuffer.data()),
+                                                                    flatbuffer.size())) {}
+
+    explicit ModelWrapper(std::unique_ptr<tflite::FlatBufferModel> flatbuffer_model) : model(std::move(flatbuffer_model)) {
         using namespace tflite;
         using namespace tflite::ops::builtin;
-        model = tflite::FlatBufferModel::BuildFromFile(model_path.c_str());
-        tflite::MutableOpResolver resolver;
+        if (!model)
+            throw std::runtime_error("Could not load the model");
         resolver.AddBuiltin(BuiltinOperator_ABS, Register_ABS(), 1, 5);
         resolver.AddBuiltin(BuiltinOperator_HARD_SWISH, Register_HARD_SWISH());
         resolver.AddBuiltin(BuiltinOperator_RELU, Register_RELU(), 1, 3);
@@ -198,6 +210,21 @@ public:
         resolver.AddBuiltin(BuiltinOperator_STABLEHLO_PAD, Register_STABLEHLO_PAD());
         resolver.AddBuiltin(BuiltinOperator_STABLEHLO_COMPOSITE, Register_STABLEHLO_COMPOSITE());
         resolver.AddBuiltin(BuiltinOperator_STABLEHLO_CASE, Register_STABLEHLO_CASE());
+        init_interpreter();
+    }
+
+    /** Creates a model with its own interpreter that shares the weights of the given one. */
+    ModelWrapper(const ModelWrapper &other) : model(other.model), resolver(other.resolver) {
+        init_interpreter();
+    }
+
+    ModelWrapper(ModelWrapper &&) = default;
+
+    ModelWrapper &operator=(ModelWrapper &&) = default;
+
+private:
+
+    void init_interpreter() {
         tflite::InterpreterBuilder builder(*model, resolver);
         builder(&interpreter);
         interpreter->SetNumThreads(1);
@@ -226,8 +253,19 @@ public:
         output_span = std::span(interpreter->typed_output_tensor<float>(0), std::max<size_t>(2, output_dims));
     }
 
+public:
+
     size_t model_bytes() const { return bytes; }
 
+    /** Identifies the engine in saved LSFs, as other engines differ from TFLite in the last bits of the outputs. */
+    static std::string engine_name() { return "tflite"; }
+
+    /** The serialized model, as loaded from its file or buffer. */
+    std::span<const std::byte> flatbuffer() const {
+        auto *allocation = model->allocation();
+        return {static_cast<const std::byte *>(allocation->base()), allocation->bytes()};
+    }
+
     std::span<float> invoke(std::span<const float> example) {
         std::copy(example.begin(), example.end(), input_span.begin());
         interpreter->Invoke();
@@ -238,5 +276,7 @@ public:
         return output_span;
     }
 
+    size_t output_width() const { return output_span.size(); }
+
 };
 }
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace lsf {
+
+    /**
+     * The CPUs of every NUMA node, as listed in sysfs. Nodes are numbered densely from 0 and only include nodes with
+     * CPUs, node_id() gives the kernel's number. Without NUMA information, e.g., in a container that hides it, the
+     * machine is a single node with all CPUs.
+     */
+    class NumaTopology {
+        std::vector<std::vector<unsigned>> nodeCpus;
+        std::vector<unsigned> nodeIds;
+        std::vector<size_t> cpuNode;
+
+    public:
+        NumaTopology() {
+            const std::string sysfs = "/sys/devices/system/node/";
+            for (unsigned id: parse_cpu_list(read_line(sysfs + "online"))) {
+                auto cpus = parse_cpu_list(read_line(sysfs + "node" + std::to_string(id) + "/cpulist"));
+                if (cpus.empty())
+                    continue;
+                nodeCpus.push_back(std::move(cpus));
+                nodeIds.push_back(id);
+            }
+            if (nodeCpus.empty()) {
+                nodeIds = {0};
+                nodeCpus.emplace_back();
+                for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                    nodeCpus[0].push_back(cpu);
+            }
+            for (size_t node = 0; node < nodeCpus.size(); ++node) {
+                for (unsigned cpu: nodeCpus[node]) {
+                    if (cpu >= cpuNode.size())
+                        cpuNode.resize(cpu + 1);
+                    cpuNode[cpu] = node;
+                }
+            }
+        }
+
+        size_t nodes() const { return nodeCpus.size(); }
+
+        unsigned node_id(size_t node) const { return nodeIds[node]; }
+
+        const std::vector<unsigned> &cpus(size_t node) const { return nodeCpus[node]; }
+
+        /** All CPUs, alternating between the nodes, so that a prefix of the list spreads evenly over the nodes. */
+        std::vector<unsigned> interleaved_cpus() const {
+            std::vector<unsigned> interleaved;
+            for (size_t i = 0;; ++i) {
+                size_t before = interleaved.size();
+                for (const auto &cpus: nodeCpus)
+                    if (i < cpus.size())
+                        interleaved.push_back(cpus[i]);
+                if (interleaved.size() == before)
+                    break;
+            }
+            return interleaved;
+        }
+
+        size_t node_of_cpu(unsigned cpu) const {
+            return cpu < cpuNode.size() ? cpuNode[cpu] : 0;
+        }
+
+        /** The node of the CPU the calling thread currently runs on. */
+        size_t current_node() const {
+            int cpu = sched_getcpu();
+            return cpu < 0 ? 0 : node_of_cpu(unsigned(cpu));
+        }
+
+    private:
+
+        static std::string read_line(const std::string &path) {
+            std::ifstream in(path);
+            std::string line;
+            std::getline(in, line);
+            return line;
+        }
+
+        /* sysfs lists CPUs and nodes as comma separated ranges, e.g., "0-7,16-23". */
+        static std::vector<unsigned> parse_cpu_list(const std::string &ranges) {
+            std::vector<unsigned> cpus;
+            std::istringstream in(ranges);
+            std::string range;
+            while (std::getline(in, range, ',')) {
+                if (range.empty())
+                    continue;
+                size_t dash = range.find('-');
+                unsigned first = std::stoul(range.substr(0, dash));
+                unsigned last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+                for (unsigned cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(cpu);
+            }
+            return cpus;
+        }
+    };
+
+    /** Restricts the calling thread to the given CPUs. */
+    inline void pin_current_thread(std::span<const unsigned> cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned cpu: cpus)
+            CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    /*
+     * Makes the memory the calling thread allocates from now on come from the given node, falling back to other
+     * nodes when it is full. Calls set_mempolicy directly, so that there is no dependency on libnuma.
+     */
+    inline void prefer_node_memory(size_t node) {
+        constexpr int MPOL_PREFERRED_MODE = 1;
+        constexpr size_t MAX_NODES = 1024;
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+        if (node >= MAX_NODES)
+            return;
+        mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED_MODE, mask, MAX_NODES);
+    }
+
+    /**
+     * One copy of a LearnedStaticFunction per NUMA node, so that query threads read the retrieval tables from local
+     * memory. Each replica is loaded from a saved image of the original by a thread running on its node. The model
+     * is shared by all replicas, as it is small compared with the tables, and each querying thread has its own
+     * QueryContext anyway. The original is not needed afterwards. Needs a storage that supports save() and load().
+     */
+    template<typename LSF>
+    class NumaReplicatedLSF {
+        NumaTopology topology_;
+        std::vector<std::unique_ptr<LSF>> replicas;
+
+    public:
+        template<typename Model>
+        NumaReplicatedLSF(const LSF &lsf, Model &model) : replicas(topology_.nodes()) {
+            std::ostringstream os(std::ios::binary);
+            lsf.save(os);
+            const std::string image = std::move(os).str();
+            const std::span<const std::byte> bytes(reinterpret_cast<const std::byte *>(image.data()), image.size());
+            for (size_t node = 0; node < replicas.size(); ++node) {
+                // a loader failure, e.g., bad_alloc under the node's memory policy, is rethrown here
+                std::exception_ptr failure;
+                std::thread loader([&, node] {
+                    try {
+                        pin_current_thread(topology_.cpus(node));
+                        prefer_node_memory(topology_.node_id(node));
+                        replicas[node] = std::make_unique<LSF>(bytes, model);
+                    } catch (...) {
+                        failure = std::current_exception();
+                    }
+                });
+                loader.join();
+                if (failure)
+                    std::rethrow_exception(failure);
+            }
+        }
+
+        const NumaTopology &topology() const { return topology_; }
+
+        const LSF &replica(size_t node) const { return *replicas[node]; }
+
+        /** The replica on the node of the calling thread. */
+        const LSF &local() const { return *replicas[topology_.current_node()]; }
+
+        /**
+         * Pins the calling thread, the t-th of a group of query threads, and returns its replica. The threads are
+         * spread round robin over the nodes and within a node over its CPUs.
+         */
+        const LSF &pin_query_thread(size_t t) const {
+            size_t node = t % replicas.size();
+            const auto &cpus = topology_.cpus(node);
+            unsigned cpu = cpus[(t / replicas.size()) % cpus.size()];
+            pin_current_thread(std::span(&cpu, 1));
+            return *replicas[node];
+        }
+    };
+}
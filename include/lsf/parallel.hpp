@@ -0,0 +1,29 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace lsf {
+
+    /**
+     * Splits [0, n) into one contiguous chunk per thread and calls f(begin, end, thread) on each chunk.
+     * The calling thread processes the first chunk, so threads == 1 runs sequentially without spawning.
+     */
+    template<typename F>
+    void parallel_for(size_t n, size_t threads, F f) {
+        threads = std::max<size_t>(1, std::min(threads, n));
+        size_t chunk = (n + threads - 1) / std::max<size_t>(1, threads);
+        std::vector<std::thread> workers;
+        workers.reserve(threads - 1);
+        for (size_t t = 1; t < threads; ++t) {
+            size_t begin = std::min(n, t * chunk);
+            size_t end = std::min(n, begin + chunk);
+            workers.emplace_back([&f, begin, end, t] { f(begin, end, t); });
+        }
+        f(0, std::min(n, chunk), 0);
+        for (auto &w: workers)
+            w.join();
+    }
+}
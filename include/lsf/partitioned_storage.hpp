@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <span>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "build_stats.hpp"
+#include "hashing.hpp"
+#include "huge_pages.hpp"
+#include "parallel.hpp"
+#include "persistence.hpp"
+
+namespace lsf {
+
+    constexpr size_t defaultKeysPerShard = size_t(1) << 22;
+    constexpr size_t defaultShardBuildBudgetBytes = size_t(8) << 30;
+
+    /**
+     * Counts bytes reserved by concurrently running tasks and blocks acquire() while the budget is exhausted. A
+     * request larger than the whole budget is granted once nothing else is reserved, so it cannot deadlock. The
+     * largest sum reserved at once is kept as the peak.
+     */
+    class MemoryBudget {
+        std::mutex mutex;
+        std::condition_variable released;
+        size_t budget;
+        size_t used = 0;
+        size_t peak = 0;
+
+    public:
+        explicit MemoryBudget(size_t budgetBytes) : budget(budgetBytes) {}
+
+        void acquire(size_t bytes) {
+            std::unique_lock lock(mutex);
+            released.wait(lock, [&] { return used == 0 || used + bytes <= budget; });
+            used += bytes;
+            peak = std::max(peak, used);
+        }
+
+        void release(size_t bytes) {
+            {
+                std::lock_guard lock(mutex);
+                used -= bytes;
+            }
+            released.notify_all();
+        }
+
+        size_t budget_bytes() const { return budget; }
+
+        size_t peak_bytes() {
+            std::lock_guard lock(mutex);
+            return peak;
+        }
+    };
+
+    /**
+     * Splits the keys by hash into independent shards of about keysPerShard keys, each stored in its own Storage.
+     * The shard of a key is selected by the high bits of its hash, so a query touches a single shard. Shards are
+     * built in parallel, one per getter, while the estimated build memory of the running shards stays within the
+     * budget. All shards share the model of the enclosing LearnedStaticFunction.
+     */
+    template<typename Storage>
+    class PartitionedLSFStorage {
+        std::vector<Storage> shards;
+        std::vector<uint64_t> shardSizes;
+        size_t keysPerShard;
+        size_t buildBudgetBytes;
+        HugePageMode tablePages = HugePageMode::NONE;
+
+    public:
+        // the least stash of a shard whose rows and ribbon temporaries alone exceed the budget, so it still spills
+        // in chunks instead of key by key
+        static constexpr size_t MIN_STASH_BYTES = size_t(1) << 20;
+
+        PartitionedLSFStorage(size_t keysPerShard = defaultKeysPerShard,
+                              size_t buildBudgetBytes = defaultShardBuildBudgetBytes)
+                : keysPerShard(std::max<size_t>(1, keysPerShard)), buildBudgetBytes(buildBudgetBytes) {}
+
+        /** Places the retrieval tables of all shards on huge pages, see the set_huge_pages() of the Storage. */
+        void set_huge_pages(HugePageMode mode) {
+            require_huge_page_new(mode);
+            tablePages = mode;
+        }
+
+        size_t huge_page_bytes() const {
+            size_t bytes = 0;
+            for (size_t s = 0; s < shards.size(); ++s)
+                if (shardSizes[s] > 0)
+                    bytes += shards[s].huge_page_bytes();
+            return bytes;
+        }
+
+        template<typename F>
+        BuildStats build(size_t n, size_t classes_count, F get) {
+            return build(n, classes_count, std::span<F>(&get, 1));
+        }
+
+        /*
+         * Routing only needs the key hashes. If the getters provide key_hash(i), the model is not invoked for it
+         * and the hashes are computed twice instead of remembering the shard of every key, otherwise every key is
+         * evaluated once more. The routing memory counts against the build budget, and every shard reserves its
+         * input rows, ribbon temporaries and stash from the rest, see Storage::build_bytes(). The stash gets what
+         * is left, up to all decisions of the shard, and spills beyond. The returned report sums up the shards, its
+         * peak temporary memory is that of the routing plus the most reserved by the shards at once.
+         */
+        template<typename F>
+        BuildStats build(size_t n, size_t classes_count, std::span<F> gets) {
+            if (n <= std::numeric_limits<uint32_t>::max())
+                return build_routed<uint32_t>(n, classes_count, gets);
+            return build_routed<uint64_t>(n, classes_count, gets);
+        }
+
+        /** The decoding scratch of every shard, as each shard has its own coder. */
+        using Scratch = std::vector<typename Storage::Scratch>;
+
+        Scratch make_scratch() const {
+            Scratch scratch;
+            scratch.reserve(shards.size());
+            for (size_t s = 0; s < shards.size(); ++s)
+                scratch.push_back(shardSizes[s] > 0 ? shards[s].make_scratch() : typename Storage::Scratch());
+            return scratch;
+        }
+
+        /*
+         * An empty shard is never built, so a key routed to it cannot be a member and its queries return 0 without
+         * touching the shard.
+         */
+        std::pair<uint64_t, uint64_t> query_storage(uint64_t hash) const {
+            size_t s = shard_of(hash, shards.size());
+            if (shardSizes[s] == 0)
+                return {0, 0};
+            return shards[s].query_storage(shard_hash(hash));
+        }
+
+        void prefetch(uint64_t hash) const {
+            size_t s = shard_of(hash, shards.size());
+            if (shardSizes[s] > 0)
+                shards[s].prefetch(shard_hash(hash));
+        }
+
+        void prefetch_filter(uint64_t hash) const {
+            size_t s = shard_of(hash, shards.size());
+            if (shardSizes[s] > 0)
+                shards[s].prefetch_filter(shard_hash(hash));
+        }
+
+        uint64_t query(uint64_t hash, std::span<float> probabilities) {
+            size_t s = shard_of(hash, shards.size());
+            if (shardSizes[s] == 0)
+                return 0;
+            return shards[s].query(shard_hash(hash), probabilities);
+        }
+
+        uint64_t query(uint64_t hash, std::span<float> probabilities, Scratch &scratch) const {
+            size_t s = shard_of(hash, shards.size());
+            if (shardSizes[s] == 0)
+                return 0;
+            return shards[s].query(shard_hash(hash), probabilities, scratch[s]);
+        }
+
+        size_t size_in_bytes() const {
+            size_t bytes = sizeof(Storage) * shards.size();
+            for (size_t s = 0; s < shards.size(); ++s)
+                if (shardSizes[s] > 0)
+                    bytes += shards[s].size_in_bytes();
+            return bytes;
+        }
+
+        void save(BinaryWriter &out) const {
+            out.write_string(get_name());
+            out.write<uint64_t>(shards.size());
+            for (size_t s = 0; s < shards.size(); ++s) {
+                out.write<uint64_t>(shardSizes[s]);
+                if (shardSizes[s] > 0)
+                    shards[s].save(out);
+            }
+        }
+
+        void load(BinaryReader &in) {
+            if (in.read_string() != get_name())
+                throw std::runtime_error("The LSF file was written with a different storage");
+            shards = std::vector<Storage>(in.read<uint64_t>());
+            shardSizes.resize(shards.size());
+            for (size_t s = 0; s < shards.size(); ++s) {
+                shards[s].set_huge_pages(tablePages);
+                shardSizes[s] = in.read<uint64_t>();
+                if (shardSizes[s] > 0)
+                    shards[s].load(in);
+            }
+        }
+
+        size_t get_statistic_bits_input() const {
+            size_t bits = 0;
+            for (size_t s = 0; s < shards.size(); ++s)
+                if (shardSizes[s] > 0)
+                    bits += shards[s].get_statistic_bits_input();
+            return bits;
+        }
+
+        size_t shard_count() const { return shards.size(); }
+
+        static const std::string get_name() {
+            return "Partitioned-" + Storage::get_name();
+        }
+
+    private:
+
+        /* Index is the type of the key indices in the routing, the narrowest that holds n. */
+        template<typename Index, typename F>
+        BuildStats build_routed(size_t n, size_t classes_count, std::span<F> gets) {
+            const size_t threads = gets.size();
+            const size_t shardCount = std::max<size_t>(1, (n + keysPerShard - 1) / keysPerShard);
+            shards = std::vector<Storage>(shardCount);
+            for (Storage &shard: shards)
+                shard.set_huge_pages(tablePages);
+
+            constexpr bool hashOnly = requires { gets[0].key_hash(size_t(0)); };
+            auto keyShard = [&](size_t t, size_t i) -> uint32_t {
+                if constexpr (hashOnly)
+                    return shard_of(gets[t].key_hash(i), shardCount);
+                else
+                    return shard_of(std::get<0>(gets[t](i)), shardCount);
+            };
+
+            // counting sort of the key indices by shard, each worker scatters its own chunk behind the earlier ones
+            std::vector<uint32_t> shardOf(hashOnly ? 0 : n);
+            std::vector<std::vector<size_t>> workerCounts(threads, std::vector<size_t>(shardCount));
+            parallel_for(n, threads, [&](size_t begin, size_t end, size_t t) {
+                for (size_t i = begin; i < end; ++i) {
+                    uint32_t s = keyShard(t, i);
+                    if constexpr (!hashOnly)
+                        shardOf[i] = s;
+                    ++workerCounts[t][s];
+                }
+            });
+            std::vector<size_t> offsets(shardCount + 1);
+            for (size_t s = 0; s < shardCount; ++s)
+                for (size_t t = 0; t < threads; ++t)
+                    offsets[s + 1] += workerCounts[t][s];
+            std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+            shardSizes.resize(shardCount);
+            for (size_t s = 0; s < shardCount; ++s)
+                shardSizes[s] = offsets[s + 1] - offsets[s];
+            // from here on, workerCounts[t][s] is the next position of worker t in the keys of shard s
+            for (size_t s = 0; s < shardCount; ++s) {
+                size_t fill = offsets[s];
+                for (size_t t = 0; t < threads; ++t)
+                    fill += std::exchange(workerCounts[t][s], fill);
+            }
+            std::vector<Index> indices(n);
+            parallel_for(n, threads, [&](size_t begin, size_t end, size_t t) {
+                for (size_t i = begin; i < end; ++i) {
+                    uint32_t s;
+                    if constexpr (hashOnly)
+                        s = keyShard(t, i);
+                    else
+                        s = shardOf[i];
+                    indices[workerCounts[t][s]++] = Index(i);
+                }
+            });
+            const size_t routingPeakBytes = shardOf.size() * sizeof(uint32_t) + n * sizeof(Index)
+                                            + (threads + 1) * shardCount * sizeof(size_t);
+            shardOf = std::vector<uint32_t>();
+            workerCounts = {};
+            const size_t routingBytes = n * sizeof(Index) + offsets.size() * sizeof(size_t);
+
+            // the routing stays alive during the shard builds, a budget it exhausts lets them run one at a time
+            MemoryBudget budget(buildBudgetBytes > routingBytes ? buildBudgetBytes - routingBytes : 0);
+            auto shardBytes = [&](size_t keys) {
+                const size_t fixed = Storage::build_bytes(keys);
+                const size_t left = budget.budget_bytes() > fixed ? budget.budget_bytes() - fixed : 0;
+                return std::make_pair(fixed, std::min(Storage::stash_bytes(keys), std::max(MIN_STASH_BYTES, left)));
+            };
+            std::vector<BuildStats> shardStats(shardCount);
+            std::atomic<size_t> nextShard = 0;
+            parallel_for(threads, threads, [&](size_t, size_t, size_t t) {
+                for (size_t s = nextShard++; s < shardCount; s = nextShard++) {
+                    std::span<const Index> keys(indices.data() + offsets[s], offsets[s + 1] - offsets[s]);
+                    if (keys.empty())
+                        continue;
+                    auto get = [&, t, keys](size_t j) {
+                        auto [hash, label, probabilities] = gets[t](keys[j]);
+                        return std::make_tuple(shard_hash(hash), label, probabilities);
+                    };
+                    auto [fixedBytes, stashBytes] = shardBytes(keys.size());
+                    shards[s].set_stash_budget(stashBytes);
+                    budget.acquire(fixedBytes + stashBytes);
+                    shardStats[s] = shards[s].build(keys.size(), classes_count, get);
+                    budget.release(fixedBytes + stashBytes);
+                }
+            });
+
+            BuildStats stats;
+            for (const BuildStats &shard: shardStats)
+                stats.merge(shard);
+            stats.peakTemporaryBytes = std::max(routingPeakBytes, routingBytes + budget.peak_bytes());
+            return stats;
+        }
+
+        static uint32_t shard_of(uint64_t hash, size_t shardCount) {
+            return uint32_t(((hash >> 32) * shardCount) >> 32);
+        }
+
+        /*
+         * All keys of a shard agree on the high hash bits, so they are remixed before reaching the shard's
+         * retrievals. hash_key is a bijection, hence distinct keys keep distinct hashes.
+         */
+        static uint64_t shard_hash(uint64_t hash) {
+            return hash_key(hash);
+        }
+    };
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <concepts>
+#include <cstring>
+#include <ostream>
+#include <span>
+#include <spanstream>
+#include <istream>
+#include <stdexcept>
+#include <string>
+
+/*
+ * On-disk format of a LearnedStaticFunction (native byte order):
+ *
+ *   uint32 magic, uint32 version, inference engine name
+ *   uint64 model bytes (0 if the model is not embedded), padding to 64 bytes, model flatbuffer
+ *   storage name, number of classes, statistics, coder frequencies, filter retrieval, correction retrieval
+ *
+ * The model is stored first and aligned, so that it can be used directly from a mapping of the file. The retrievals
+ * cannot: they own the layout of their tables, so loading copies each of them out of the mapping once. The codes
+ * are only decodable with the exact probabilities of construction, so a file is only loaded by the engine that
+ * built it.
+ */
+
+namespace lsf {
+    constexpr uint32_t FILE_MAGIC = 0x0046534C; // "LSF\0"
+    constexpr uint32_t FILE_VERSION = 3; // 2: keys are hashed with hash_key instead of XXH3, 3: engine name
+    constexpr size_t FILE_ALIGNMENT = 64;
+
+    class BinaryWriter {
+        std::ostream &os;
+        size_t offset = 0;
+
+    public:
+
+        explicit BinaryWriter(std::ostream &os) : os(os) {}
+
+        void write_bytes(std::span<const std::byte> bytes) {
+            os.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+            offset += bytes.size();
+            if (!os)
+                throw std::runtime_error("Could not write LSF file");
+        }
+
+        template<typename T>
+        void write(const T &t) {
+            static_assert(std::is_trivially_copyable_v<T>);
+            write_bytes(std::as_bytes(std::span(&t, 1)));
+        }
+
+        /*
+         * Writes the bytes that serialize(std::ostream &) produces, prefixed with their count. serialize is called
+         * twice, first to count the bytes, so nothing is buffered in between.
+         */
+        template<typename F>
+        void write_serialized(F serialize) {
+            CountingBuffer counter;
+            std::ostream counting(&counter);
+            serialize(counting);
+            write<uint64_t>(counter.bytes);
+            serialize(os);
+            offset += counter.bytes;
+            if (!os)
+                throw std::runtime_error("Could not write LSF file");
+        }
+
+        void write_string(const std::string &s) {
+            write<uint64_t>(s.size());
+            write_bytes(std::as_bytes(std::span(s)));
+        }
+
+        void align(size_t alignment) {
+            static constexpr std::byte zeros[FILE_ALIGNMENT] = {};
+            write_bytes(std::span(zeros, (alignment - offset % alignment) % alignment));
+        }
+
+    private:
+
+        /** Discards what is written to it and counts the bytes. */
+        struct CountingBuffer : std::streambuf {
+            uint64_t bytes = 0;
+
+            std::streamsize xsputn(const char *, std::streamsize n) override {
+                bytes += n;
+                return n;
+            }
+
+            int_type overflow(int_type c) override {
+                if (!traits_type::eq_int_type(c, traits_type::eof()))
+                    bytes++;
+                return traits_type::not_eof(c);
+            }
+        };
+    };
+
+    /** Reads from an in-memory image of a file, e.g., a MappedFile, without copying byte ranges. */
+    class BinaryReader {
+        std::span<const std::byte> data;
+        size_t offset = 0;
+
+    public:
+
+        explicit BinaryReader(std::span<const std::byte> data) : data(data) {}
+
+        std::span<const std::byte> read_bytes(size_t n) {
+            if (n > data.size() - offset)
+                throw std::runtime_error("Truncated LSF file");
+            auto result = data.subspan(offset, n);
+            offset += n;
+            return result;
+        }
+
+        template<typename T>
+        T read() {
+            static_assert(std::is_trivially_copyable_v<T>);
+            T t;
+            std::memcpy(&t, read_bytes(sizeof(T)).data(), sizeof(T));
+            return t;
+        }
+
+        std::string read_string() {
+            auto bytes = read_bytes(read<uint64_t>());
+            return {reinterpret_cast<const char *>(bytes.data()), bytes.size()};
+        }
+
+        void align(size_t alignment) {
+            read_bytes((alignment - offset % alignment) % alignment);
+        }
+    };
+
+    /**
+     * A retrieval structure with its own stream interface, i.e., a Serialize(std::ostream &) member and a static
+     * Deserialize(std::istream &).
+     */
+    template<typename Retrieval>
+    concept SerializableRetrieval = requires(const Retrieval &retrieval, std::ostream &os, std::istream &is) {
+        retrieval.Serialize(os);
+        { Retrieval::Deserialize(is) } -> std::convertible_to<Retrieval>;
+    };
+
+    /** Streams the retrieval straight into the file, without an intermediate copy. */
+    template<SerializableRetrieval Retrieval>
+    void save_retrieval(BinaryWriter &out, const Retrieval &retrieval) {
+        out.write_serialized([&](std::ostream &os) { retrieval.Serialize(os); });
+    }
+
+    /** Deserializes directly from the image of the file, which is the only copy of the retrieval's tables. */
+    template<SerializableRetrieval Retrieval>
+    Retrieval load_retrieval(BinaryReader &in) {
+        auto bytes = in.read_bytes(in.read<uint64_t>());
+        std::ispanstream is(std::span(reinterpret_cast<const char *>(bytes.data()), bytes.size()));
+        return Retrieval::Deserialize(is);
+    }
+
+    struct FileHeader {
+        std::string engine;
+        std::span<const std::byte> model;
+    };
+
+    /** Writes the file header, followed by the given model flatbuffer (which may be empty). */
+    inline void write_header(BinaryWriter &out, const std::string &engine, std::span<const std::byte> model) {
+        out.write(FILE_MAGIC);
+        out.write(FILE_VERSION);
+        out.write_string(engine);
+        out.write<uint64_t>(model.size());
+        out.align(FILE_ALIGNMENT);
+        out.write_bytes(model);
+    }
+
+    /** Checks the file header and returns it, leaving the reader at the start of the storage. */
+    inline FileHeader read_header(BinaryReader &in) {
+        if (in.read<uint32_t>() != FILE_MAGIC)
+            throw std::runtime_error("Not an LSF file");
+        if (in.read<uint32_t>() != FILE_VERSION)
+            throw std::runtime_error("Unsupported LSF file version");
+        FileHeader header;
+        header.engine = in.read_string();
+        auto bytes = in.read<uint64_t>();
+        in.align(FILE_ALIGNMENT);
+        header.model = in.read_bytes(bytes);
+        return header;
+    }
+
+    /** Like read_header(), but rejects files that were built with another inference engine. */
+    inline std::span<const std::byte> read_header(BinaryReader &in, const std::string &engine) {
+        FileHeader header = read_header(in);
+        if (header.engine != engine)
+            throw std::runtime_error("The LSF file was built with the " + header.engine
+                                     + " inference engine and cannot be decoded with " + engine);
+        return header.model;
+    }
+
+    /** Returns the model embedded in a saved LSF, pointing into the given image of the file. */
+    inline std::span<const std::byte> embedded_model(std::span<const std::byte> file) {
+        BinaryReader in(file);
+        return read_header(in).model;
+    }
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace lsf {
+
+    /**
+     * A single query running as a coroutine. It is created suspended, and every resume() runs it up to its next
+     * memory stall, where it has issued prefetches for the data it is about to read and yields to other queries.
+     */
+    class QueryTask {
+    public:
+        struct promise_type {
+            uint64_t value = 0;
+            std::exception_ptr exception;
+
+            QueryTask get_return_object() {
+                return QueryTask(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            std::suspend_always final_suspend() noexcept { return {}; }
+
+            void return_value(uint64_t result) { value = result; }
+
+            void unhandled_exception() { exception = std::current_exception(); }
+
+            /*
+             * All frames of a coroutine function have the same size, so a thread recycles them through a short
+             * free list instead of calling the allocator once per query.
+             */
+            static void *operator new(size_t size) {
+                FramePool &pool = frame_pool();
+                if (size == pool.frameSize && !pool.frames.empty()) {
+                    void *frame = pool.frames.back();
+                    pool.frames.pop_back();
+                    return frame;
+                }
+                return ::operator new(size);
+            }
+
+            static void operator delete(void *frame, size_t size) {
+                FramePool &pool = frame_pool();
+                if (pool.frameSize == 0)
+                    pool.frameSize = size;
+                if (size == pool.frameSize && pool.frames.size() < FramePool::CAPACITY)
+                    pool.frames.push_back(frame);
+                else
+                    ::operator delete(frame);
+            }
+        };
+
+        QueryTask() = default;
+
+        QueryTask(QueryTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+        QueryTask &operator=(QueryTask &&other) noexcept {
+            if (this != &other) {
+                reset();
+                handle = std::exchange(other.handle, nullptr);
+            }
+            return *this;
+        }
+
+        ~QueryTask() { reset(); }
+
+        explicit operator bool() const { return handle != nullptr; }
+
+        /** Runs the query up to its next stall. Returns true once it has finished. */
+        bool resume() {
+            handle.resume();
+            return handle.done();
+        }
+
+        /** The value of a finished query. Rethrows an exception that escaped the query. */
+        uint64_t result() const {
+            if (handle.promise().exception)
+                std::rethrow_exception(handle.promise().exception);
+            return handle.promise().value;
+        }
+
+        void reset() {
+            if (handle)
+                std::exchange(handle, nullptr).destroy();
+        }
+
+    private:
+        struct FramePool {
+            static constexpr size_t CAPACITY = 256;
+            size_t frameSize = 0;
+            std::vector<void *> frames;
+
+            ~FramePool() {
+                for (void *frame: frames)
+                    ::operator delete(frame);
+            }
+        };
+
+        static FramePool &frame_pool() {
+            thread_local FramePool pool;
+            return pool;
+        }
+
+        std::coroutine_handle<promise_type> handle;
+
+        explicit QueryTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    };
+
+    /**
+     * Interleaves up to inFlight queries of one thread on a LearnedStaticFunction. Queries are submitted one at a
+     * time, as they arrive, and run as coroutines that are resumed round robin. While a query waits for its
+     * retrieval rows, the others advance, so callers with irregular request streams hide the memory latency without
+     * forming batches. Each result is handed to onResult(tag, value), in completion order. The features passed to
+     * submit() must stay valid until the result of that query was delivered.
+     *
+     * An executor belongs to a single thread. The queries share one QueryContext, which is sound because a query
+     * only suspends before it invokes the model, never between inference and decoding.
+     */
+    template<typename LSF, typename OnResult>
+    class InterleavedQueryExecutor {
+        struct Slot {
+            QueryTask task;
+            uint64_t tag = 0;
+        };
+
+        const LSF &lsf;
+        typename LSF::QueryContext context;
+        OnResult onResult;
+        std::vector<Slot> slots;
+        std::vector<size_t> freeSlots;
+        size_t cursor = 0;
+
+    public:
+        InterleavedQueryExecutor(const LSF &lsf, size_t inFlight, OnResult onResult)
+                : lsf(lsf), context(lsf.make_query_context()), onResult(std::move(onResult)),
+                  slots(std::max<size_t>(1, inFlight)) {
+            for (size_t s = slots.size(); s > 0; --s)
+                freeSlots.push_back(s - 1);
+        }
+
+        InterleavedQueryExecutor(const InterleavedQueryExecutor &) = delete;
+
+        /** Starts a query. If all slots are busy, the running queries are advanced until one of them finishes. */
+        void submit(uint64_t key, std::span<const float> features, uint64_t tag) {
+            while (freeSlots.empty())
+                step();
+            size_t s = freeSlots.back();
+            freeSlots.pop_back();
+            slots[s].task = lsf.query_interleaved(key, features, context);
+            slots[s].tag = tag;
+            // runs until the first stall, which issues the prefetches
+            if (slots[s].task.resume())
+                finish(s);
+        }
+
+        /** Completes all queries that are still in flight. Queries not drained are dropped with the executor. */
+        void drain() {
+            while (in_flight() > 0)
+                step();
+        }
+
+        size_t in_flight() const { return slots.size() - freeSlots.size(); }
+
+    private:
+
+        void step() {
+            while (!slots[cursor].task)
+                cursor = (cursor + 1) % slots.size();
+            size_t s = cursor;
+            cursor = (cursor + 1) % slots.size();
+            if (slots[s].task.resume())
+                finish(s);
+        }
+
+        void finish(size_t s) {
+            QueryTask task = std::move(slots[s].task);
+            freeSlots.push_back(s);
+            onResult(slots[s].tag, task.result());
+        }
+    };
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <x86intrin.h>
+
+/*
+ * Per-phase query instrumentation. It costs a few rdtsc per query, so it is compiled in only when
+ * LSF_QUERY_PROFILING is set to 1 (cmake -DLSF_QUERY_PROFILING=ON). Otherwise, profile_phase() just calls its function.
+ */
+#ifndef LSF_QUERY_PROFILING
+#define LSF_QUERY_PROFILING 0
+#endif
+
+namespace lsf {
+
+    constexpr bool queryProfiling = LSF_QUERY_PROFILING;
+
+    enum class QueryPhase : uint8_t {
+        HASH, INFERENCE, RETRIEVAL, DECODE, COUNT
+    };
+
+    inline const char *phase_name(QueryPhase phase) {
+        static constexpr const char *names[] = {"hash", "inference", "retrieval", "decode"};
+        return names[size_t(phase)];
+    }
+
+    /**
+     * Cycles spent in the phases of the profiled queries. Every call of a phase adds to its cycle counter, while only
+     * every SAMPLE_INTERVAL-th call is recorded in its histogram. The histogram buckets are logarithmic with four
+     * sub-buckets per power of two, so percentiles are accurate to within 25%.
+     */
+    struct QueryProfile {
+        static constexpr size_t SAMPLE_INTERVAL = 64;
+        static constexpr size_t SUB_BUCKET_BITS = 2;
+        static constexpr size_t BUCKETS = 64 << SUB_BUCKET_BITS;
+
+        struct Phase {
+            uint64_t calls = 0;
+            uint64_t cycles = 0;
+            uint64_t samples = 0;
+            std::array<uint64_t, BUCKETS> histogram = {};
+
+            double mean_cycles() const {
+                return calls == 0 ? 0.0 : double(cycles) / double(calls);
+            }
+
+            /** Lower bound of the histogram bucket holding the q-quantile of the sampled calls. */
+            uint64_t percentile_cycles(double q) const {
+                if (samples == 0)
+                    return 0;
+                uint64_t rank = uint64_t(q * double(samples - 1)) + 1;
+                for (size_t b = 0; b < BUCKETS; ++b) {
+                    if (histogram[b] >= rank)
+                        return bucket_lower_bound(b);
+                    rank -= histogram[b];
+                }
+                return bucket_lower_bound(BUCKETS - 1);
+            }
+
+            void add(const Phase &other) {
+                calls += other.calls;
+                cycles += other.cycles;
+                samples += other.samples;
+                for (size_t b = 0; b < BUCKETS; ++b)
+                    histogram[b] += other.histogram[b];
+            }
+        };
+
+        std::array<Phase, size_t(QueryPhase::COUNT)> phases;
+
+        const Phase &operator[](QueryPhase phase) const { return phases[size_t(phase)]; }
+
+        Phase &operator[](QueryPhase phase) { return phases[size_t(phase)]; }
+
+        static size_t bucket_of(uint64_t cycles) {
+            if (cycles < (uint64_t(1) << SUB_BUCKET_BITS))
+                return cycles;
+            size_t exponent = std::bit_width(cycles) - 1;
+            uint64_t sub = (cycles >> (exponent - SUB_BUCKET_BITS)) & ((uint64_t(1) << SUB_BUCKET_BITS) - 1);
+            return ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) | sub;
+        }
+
+        static uint64_t bucket_lower_bound(size_t bucket) {
+            if (bucket < (size_t(1) << SUB_BUCKET_BITS))
+                return bucket;
+            size_t exponent = (bucket >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+            uint64_t sub = bucket & ((size_t(1) << SUB_BUCKET_BITS) - 1);
+            return ((uint64_t(1) << SUB_BUCKET_BITS) | sub) << (exponent - SUB_BUCKET_BITS);
+        }
+    };
+
+    namespace detail {
+        /*
+         * Each thread records into its own profile without synchronization. The registry keeps the profiles of all
+         * threads, including finished ones, so collect_query_profile() sees every query since the last reset.
+         */
+        struct QueryProfileRegistry {
+            std::mutex mutex;
+            std::vector<std::shared_ptr<QueryProfile>> profiles;
+
+            static QueryProfileRegistry &instance() {
+                static QueryProfileRegistry registry;
+                return registry;
+            }
+        };
+
+        inline QueryProfile &thread_query_profile() {
+            thread_local std::shared_ptr<QueryProfile> profile = [] {
+                auto created = std::make_shared<QueryProfile>();
+                QueryProfileRegistry &registry = QueryProfileRegistry::instance();
+                std::lock_guard lock(registry.mutex);
+                registry.profiles.push_back(created);
+                return created;
+            }();
+            return *profile;
+        }
+    }
+
+    /**
+     * Runs f() as the given phase of a query and returns its result. With profiling compiled in, its cycles are
+     * added to the profile of the calling thread.
+     */
+    template<QueryPhase phase, typename F>
+    inline decltype(auto) profile_phase(F &&f) {
+        if constexpr (queryProfiling) {
+            QueryProfile::Phase &stats = detail::thread_query_profile()[phase];
+            const uint64_t start = __rdtsc();
+            decltype(auto) result = f();
+            const uint64_t cycles = __rdtsc() - start;
+            stats.cycles += cycles;
+            if (stats.calls++ % QueryProfile::SAMPLE_INTERVAL == 0) {
+                stats.histogram[QueryProfile::bucket_of(cycles)]++;
+                stats.samples++;
+            }
+            return result;
+        } else {
+            return f();
+        }
+    }
+
+    /** The phases of all queries since the last reset, summed over all threads. Empty if profiling is compiled out. */
+    inline QueryProfile collect_query_profile() {
+        QueryProfile total;
+        if constexpr (queryProfiling) {
+            auto &registry = detail::QueryProfileRegistry::instance();
+            std::lock_guard lock(registry.mutex);
+            for (const auto &profile: registry.profiles)
+                for (size_t p = 0; p < total.phases.size(); ++p)
+                    total.phases[p].add(profile->phases[p]);
+        }
+        return total;
+    }
+
+    /** Clears the profiles of all threads. Must not run concurrently with profiled queries. */
+    inline void reset_query_profile() {
+        if constexpr (queryProfiling) {
+            auto &registry = detail::QueryProfileRegistry::instance();
+            std::lock_guard lock(registry.mutex);
+            for (const auto &profile: registry.profiles)
+                *profile = QueryProfile();
+        }
+    }
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "filter_coding.hpp"
+#include "persistence.hpp"
+
+namespace lsf {
+
+    constexpr size_t recDepth = 2;
+    constexpr float slotsPerItem = 0.96;
+    struct BuRRConfig
+            : public ribbon::RConfig<128, 1, ribbon::ThreshMode::twobit, false, true, false, 0, uint64_t> {
+        static constexpr bool kUseVLR = true;
+        static constexpr Index kBucketSize = 128;
+    };
+
+    /**
+     * A retrieval data structure that stores the filter or the correction codes of a FilteredLSFStorage. It is
+     * constructed for a number of keys and the longest code length, make_row(hash, code, length) turns a code into
+     * an input row, whose first member is the hash, and QueryRetrieval(hash) returns the code in the lowest bits.
+     * With filter set, AddRange may store only the 1s of the codes, so that the 0s are arbitrary when queried.
+     * prefetch(hash) must issue the loads of QueryRetrieval(hash) without waiting for them, not just be callable.
+     * BUILD_BYTES_PER_KEY estimates the temporary memory of AddRange and BackSubst, which bounds parallel builds.
+     */
+    template<typename B>
+    concept RetrievalBackend = std::default_initializable<B> && std::movable<B>
+            && requires(B backend, const B &constBackend, typename B::Row *rows, uint64_t hash, uint64_t code,
+                        size_t length, BinaryWriter &out, BinaryReader &in) {
+        { B(length, length) };
+        { B::make_row(hash, code, length) } -> std::same_as<typename B::Row>;
+        { rows->first } -> std::convertible_to<uint64_t>;
+        backend.AddRange(rows, rows, true);
+        backend.BackSubst();
+        { constBackend.QueryRetrieval(hash) } -> std::convertible_to<uint64_t>;
+        constBackend.prefetch(hash);
+        { constBackend.Size() } -> std::convertible_to<size_t>;
+        constBackend.save(out);
+        { B::load(in) } -> std::same_as<B>;
+        { B::get_name() } -> std::convertible_to<std::string>;
+        { B::BUILD_BYTES_PER_KEY } -> std::convertible_to<size_t>;
+    };
+
+    /**
+     * Bumped ribbon retrieval with variable length results. Each key only occupies the bits of its own code, and
+     * in filter mode only those that are 1, which makes it the most compact backend.
+     */
+    class BuRRVLRBackend {
+        using Retrieval = ribbon::ribbon_filter<recDepth, BuRRConfig>;
+        Retrieval retrieval;
+
+    public:
+        using Row = std::pair<BuRRConfig::Key, BuRRConfig::ResultRowVLR>;
+
+        // a 128-bit coefficient row and a result row per slot while banding, and the keys bumped to the next layer
+        static constexpr size_t BUILD_BYTES_PER_KEY = 32;
+
+        BuRRVLRBackend() = default;
+
+        BuRRVLRBackend(size_t /* n */, size_t maxLength) : retrieval(slotsPerItem, 42, maxLength) {}
+
+        /* The length is marked by the highest bit set. */
+        static Row make_row(uint64_t hash, uint64_t code, size_t length) {
+            return {hash, static_cast<BuRRConfig::ResultRowVLR>(code | (uint64_t(1) << length))};
+        }
+
+        void AddRange(Row *begin, Row *end, bool filter = false) {
+            retrieval.AddRange(begin, end, filter);
+        }
+
+        void BackSubst() {
+            retrieval.BackSubst();
+        }
+
+        uint64_t QueryRetrieval(uint64_t hash) const {
+            return retrieval.QueryRetrieval(hash);
+        }
+
+        /** Requests the cache lines that QueryRetrieval(hash) is going to touch first. */
+        void prefetch(uint64_t hash) const {
+            retrieval.PrefetchQuery(hash);
+        }
+
+        size_t Size() const {
+            return retrieval.Size();
+        }
+
+        void save(BinaryWriter &out) const {
+            save_retrieval(out, retrieval);
+        }
+
+        static BuRRVLRBackend load(BinaryReader &in) {
+            BuRRVLRBackend backend;
+            backend.retrieval = load_retrieval<Retrieval>(in);
+            return backend;
+        }
+
+        static std::string get_name() {
+            return "BuRR-VLR";
+        }
+    };
+
+    /**
+     * Bumped ribbon retrieval with a fixed result width of WIDTH bits. Every key occupies WIDTH bits regardless of
+     * its code length, and the 0s of filter codes are stored as well, but a query is a single ribbon lookup without
+     * the length handling of BuRRVLRBackend. It suits the filter codes, which are short and bounded by the coder.
+     * Storing the 0s changes no decoding, it only spares the correction codes of keys whose filter 0s would have
+     * been queried as 1s.
+     */
+    template<uint32_t WIDTH>
+    class FixedWidthBuRRBackend {
+        using Config = ribbon::FastRetrievalConfig<WIDTH, uint64_t>;
+        using Retrieval = ribbon::ribbon_filter<recDepth, Config>;
+        Retrieval retrieval;
+
+    public:
+        using Row = std::pair<typename Config::Key, typename Config::ResultRow>;
+
+        // as for BuRRVLRBackend, the banding rows do not depend on the result width beyond a few bytes
+        static constexpr size_t BUILD_BYTES_PER_KEY = 32;
+
+        FixedWidthBuRRBackend() = default;
+
+        FixedWidthBuRRBackend(size_t n, size_t maxLength) : retrieval(std::max<size_t>(n, 1), slotsPerItem, 42) {
+            if (maxLength > WIDTH)
+                throw std::runtime_error("Codes of " + std::to_string(maxLength) + " bits do not fit into a "
+                                         + get_name() + " retrieval");
+        }
+
+        static Row make_row(uint64_t hash, uint64_t code, size_t /* length */) {
+            return {hash, static_cast<typename Config::ResultRow>(code)};
+        }
+
+        void AddRange(Row *begin, Row *end, bool /* filter */ = false) {
+            retrieval.AddRange(begin, end);
+        }
+
+        void BackSubst() {
+            retrieval.BackSubst();
+        }
+
+        uint64_t QueryRetrieval(uint64_t hash) const {
+            return uint64_t(retrieval.QueryRetrieval(hash));
+        }
+
+        /** Requests the cache lines that QueryRetrieval(hash) is going to touch first. */
+        void prefetch(uint64_t hash) const {
+            retrieval.PrefetchQuery(hash);
+        }
+
+        size_t Size() const {
+            return retrieval.Size();
+        }
+
+        void save(BinaryWriter &out) const {
+            save_retrieval(out, retrieval);
+        }
+
+        static FixedWidthBuRRBackend load(BinaryReader &in) {
+            FixedWidthBuRRBackend backend;
+            backend.retrieval = load_retrieval<Retrieval>(in);
+            return backend;
+        }
+
+        static std::string get_name() {
+            return "BuRR-" + std::to_string(WIDTH);
+        }
+    };
+
+    /** Fits the filter codes of every coder with the default filter length limit. */
+    using FixedWidthFilterBackend = FixedWidthBuRRBackend<COMMON_FILTER_LIMIT>;
+}
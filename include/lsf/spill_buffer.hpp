@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace lsf {
+
+    /**
+     * Sequential buffer of trivially copyable records with a bounded memory footprint. Records are appended with
+     * push_back and, after rewind(), read back in the same order with next(). Whenever the in-memory part exceeds
+     * the budget, it is appended to an anonymous temporary file.
+     */
+    template<typename T>
+    class SpillBuffer {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        std::vector<T> buffer;
+        size_t capacity;
+        std::FILE *file = nullptr;
+        size_t spilled = 0;
+        size_t remaining = 0;
+        size_t readPos = 0;
+
+        void spill() {
+            if (!file) {
+                file = std::tmpfile();
+                if (!file)
+                    throw std::runtime_error("Could not create a temporary file to spill to");
+            }
+            if (std::fwrite(buffer.data(), sizeof(T), buffer.size(), file) != buffer.size())
+                throw std::runtime_error("Could not write to the temporary spill file");
+            spilled += buffer.size();
+            buffer.clear();
+        }
+
+    public:
+
+        explicit SpillBuffer(size_t budgetBytes) : capacity(std::max<size_t>(1, budgetBytes / sizeof(T))) {}
+
+        SpillBuffer(SpillBuffer &&other) noexcept
+                : buffer(std::move(other.buffer)), capacity(other.capacity), file(std::exchange(other.file, nullptr)),
+                  spilled(other.spilled), remaining(other.remaining), readPos(other.readPos) {}
+
+        SpillBuffer(const SpillBuffer &) = delete;
+
+        SpillBuffer &operator=(const SpillBuffer &) = delete;
+
+        ~SpillBuffer() {
+            if (file)
+                std::fclose(file);
+        }
+
+        void push_back(const T &t) {
+            if (buffer.size() == capacity)
+                spill();
+            // grown by hand, as doubling could exceed the budget by almost its size
+            if (buffer.size() == buffer.capacity())
+                buffer.reserve(std::min(std::max<size_t>(1, 2 * buffer.size()), capacity));
+            buffer.push_back(t);
+        }
+
+        /** Switches to reading, starting from the first record. */
+        void rewind() {
+            readPos = 0;
+            if (file) {
+                spill();
+                std::rewind(file);
+                remaining = spilled;
+            }
+        }
+
+        T next() {
+            if (file && readPos == buffer.size()) {
+                buffer.reserve(std::min(capacity, remaining));
+                buffer.resize(std::min(capacity, remaining));
+                if (std::fread(buffer.data(), sizeof(T), buffer.size(), file) != buffer.size())
+                    throw std::runtime_error("Could not read from the temporary spill file");
+                remaining -= buffer.size();
+                readPos = 0;
+            }
+            return buffer[readPos++];
+        }
+
+        bool spilled_to_disk() const { return file != nullptr; }
+
+        /** Bytes held in memory, which stays within the budget. */
+        size_t memory_bytes() const { return buffer.capacity() * sizeof(T); }
+
+        /** Bytes written to the temporary file so far. */
+        size_t spilled_bytes() const { return spilled * sizeof(T); }
+    };
+}
@@ -3,18 +3,26 @@
 #include <cmath>
 #include <thread>
 #include <iostream>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <tlx/cmdline_parser.hpp>
 #include <filesystem>
+#include <optional>
+#include <ranges>
+#include <sstream>
 
 #include "ribbon.hpp"
 #include "serialization.hpp"
 #include "rocksdb/stop_watch.h"
 
+#include "lsf/huge_page_new.hpp"
 #include "lsf/learned_static_function.hpp"
 #include "lsf/dataset_gauss.hpp"
 #include "lsf/dataset_reader.hpp"
 #include "lsf/model_gauss.hpp"
 #include "lsf/model_freq.hpp"
+#include "lsf/model_native.hpp"
+#include "lsf/numa.hpp"
 
 #define QUERIES 10000000
 #define REPEATS 10
@@ -27,6 +35,20 @@ std::string dataSetInput = ALL;
 std::string storageInput = ALL;
 std::string evalModelInput = ALL;
 std::string competitorInput = ALL;
+size_t batchSize = 0;
+size_t buildThreads = 1;
+std::string persistPath;
+size_t queryThreads = 0;
+bool nativeModels = false;
+size_t shardKeys = lsf::defaultKeysPerShard;
+size_t shardBudgetMB = lsf::defaultShardBuildBudgetBytes >> 20;
+size_t prefetchDistance = lsf::defaultPrefetchDistance;
+bool noSingleQueryPrefetch = false;
+size_t inFlightQueries = 0;
+bool streamingBuild = false;
+bool numaBench = false;
+std::string hugePagesInput = "none";
+lsf::HugePageMode hugePages = lsf::HugePageMode::NONE;
 
 
 void printResult(const std::vector<std::string> &benchOutput) {
@@ -37,6 +59,75 @@ void printResult(const std::vector<std::string> &benchOutput) {
     std::cout << std::endl;
 };
 
+/*
+ * Phase breakdown of the profiled queries, only available when built with LSF_QUERY_PROFILING. Reports the mean
+ * cycles of every phase as <phase>_cycles and the sampled median and 99th percentile as <phase>_cycles_p50/_p99.
+ */
+void appendQueryProfile(const lsf::QueryProfile &profile, std::vector<std::string> &benchOutput) {
+    for (size_t p = 0; p < size_t(lsf::QueryPhase::COUNT); ++p) {
+        auto phase = lsf::QueryPhase(p);
+        const auto &stats = profile[phase];
+        std::string name = lsf::phase_name(phase);
+        std::cout << "Query phase " << name << ": " << stats.mean_cycles() << " cycles/call, p50 "
+                  << stats.percentile_cycles(0.5) << ", p99 " << stats.percentile_cycles(0.99) << "\n";
+        benchOutput.push_back(name + "_cycles=" + std::to_string(stats.mean_cycles()));
+        benchOutput.push_back(name + "_cycles_p50=" + std::to_string(stats.percentile_cycles(0.5)));
+        benchOutput.push_back(name + "_cycles_p99=" + std::to_string(stats.percentile_cycles(0.99)));
+    }
+}
+
+
+/*
+ * Thread sweep: for 1, 2, 4, ... threads up to queryThreads (and queryThreads itself), every thread is pinned to its
+ * own core and answers all queries, each from its own worker made by makeWorker() on the pinned thread. Reports the
+ * aggregate throughput as <prefix>qps_t<threads> and the average per-thread latency as
+ * <prefix>query_nanos_t<threads>. The threads take the given cores in order, or all cores if none are given.
+ */
+template<typename MakeWorker>
+void benchmarkThreadSweep(const std::vector<uint32_t> &queries, std::vector<std::string> &benchOutput,
+                          MakeWorker makeWorker, std::vector<unsigned> cpus = {}, const std::string &prefix = "") {
+    if (cpus.empty()) {
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+            cpus.push_back(cpu);
+    }
+    std::vector<size_t> threadCounts;
+    for (size_t threads = 1; threads < queryThreads; threads *= 2)
+        threadCounts.push_back(threads);
+    threadCounts.push_back(queryThreads);
+    for (size_t threads: threadCounts) {
+        std::atomic<size_t> ready = 0;
+        std::atomic<bool> go = false;
+        std::vector<uint64_t> threadNanos(threads);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                lsf::pin_current_thread(std::span(&cpus[t % cpus.size()], 1));
+                auto worker = makeWorker();
+                volatile uint64_t sum = 0;
+                ++ready;
+                while (!go.load(std::memory_order_acquire));
+                rocksdb::StopWatchNano timer(true);
+                // start at different offsets, so the threads do not query the same keys at the same time
+                for (size_t q = 0; q < queries.size(); ++q)
+                    sum += worker(queries[(q + t * queries.size() / threads) % queries.size()]);
+                threadNanos[t] = timer.ElapsedNanos();
+            });
+        }
+        while (ready.load() < threads);
+        rocksdb::StopWatchNano wall(true);
+        go.store(true, std::memory_order_release);
+        for (auto &w: workers)
+            w.join();
+        auto wallNanos = wall.ElapsedNanos();
+
+        double qps = double(threads * queries.size()) / (double(wallNanos) / 1e9);
+        double nanosKey = std::accumulate(threadNanos.begin(), threadNanos.end(), 0.0) / double(threads * queries.size());
+        std::cout << prefix << "query throughput with " << threads << " threads: " << qps << " queries/s ("
+                  << nanosKey << " ns/query per thread)\n";
+        benchOutput.push_back(prefix + "qps_t" + std::to_string(threads) + "=" + std::to_string(qps));
+        benchOutput.push_back(prefix + "query_nanos_t" + std::to_string(threads) + "=" + std::to_string(nanosKey));
+    }
+}
 
 template<typename S, typename F>
 class FilteredFano50 : public lsf::Filter50PercentWrapper<lsf::FilterFanoCoder, S, F> {
@@ -49,6 +140,38 @@ public:
     }
 };
 
+template<typename Storage>
+Storage makeStorage(lsf::HugePageMode tablePages = lsf::HugePageMode::NONE) {
+    Storage storage = [] {
+        if constexpr (std::is_constructible_v<Storage, size_t, size_t>) {
+            return Storage(shardKeys, shardBudgetMB << 20);
+        } else {
+            return Storage();
+        }
+    }();
+    if constexpr (requires { storage.set_huge_pages(tablePages); })
+        storage.set_huge_pages(tablePages);
+    return storage;
+}
+
+template<typename DataSet, typename Model, typename Storage>
+lsf::LearnedStaticFunction<DataSet, Model, Storage>
+constructLSF(const DataSet &dataset, Model &model, std::vector<std::string> &benchOutput) {
+    using Next = std::optional<std::tuple<uint64_t, uint64_t, std::span<float>>> (*)();
+    if constexpr (requires(Storage &storage, Next next) { storage.build_streaming(size_t(0), next); }) {
+        if (streamingBuild) {
+            benchOutput.emplace_back("build_mode=streaming");
+            // the dataset is consumed as a single pass over (key, label, features), the key being the index
+            auto rows = std::views::iota(size_t(0), dataset.size()) | std::views::transform([&](size_t i) {
+                return std::make_tuple(uint64_t(i), dataset.get_label(i), dataset.get_example(i));
+            });
+            return {rows.begin(), rows.end(), dataset.classes_count(), model, makeStorage<Storage>()};
+        }
+    }
+    benchOutput.emplace_back("build_mode=random_access");
+    return {dataset, model, makeStorage<Storage>(), buildThreads};
+}
+
 template<typename DataSet, typename Storage, typename Model, bool doQueries>
 void
 benchmark(const DataSet &dataset, Model &model, std::vector<std::string> benchOutput,
@@ -59,20 +182,36 @@ benchmark(const DataSet &dataset, Model &model, std::vector<std::string> benchOu
 
     benchOutput.emplace_back("comp=" + competitorName);
     benchOutput.push_back("storage_name=" + Storage::get_name());
+    // the build scans the examples in order, the queries access them at random
+    if constexpr (requires { dataset.advise(MADV_SEQUENTIAL); })
+        dataset.advise(MADV_SEQUENTIAL);
     rocksdb::StopWatchNano timer(true);
 
-    lsf::LearnedStaticFunction<DataSet, Model, Storage> lr(dataset, model);
+    auto lr = constructLSF<DataSet, Model, Storage>(dataset, model, benchOutput);
+    lr.set_prefetch_distance(prefetchDistance);
+    lr.set_single_query_prefetch(!noSingleQueryPrefetch);
 
     auto nanos = timer.ElapsedNanos(true);
+    const lsf::BuildStats &buildStats = lr.build_stats();
+    buildStats.print(std::cout);
+    std::cout << "Build report: " << buildStats.to_json() << "\n";
+    std::cout << "Model size: " << lr.model_bytes() * 8 << " bits\n";
+    std::cout << "Total size: " << lr.size_in_bytes() * 8 << " bits\n";
+    std::cout << "Total bits/example: " << (lr.size_in_bytes() * 8 / static_cast<double>(dataset.size())) << "\n";
     std::cout << "Total Construct " << nanos << " ns ("
               << (nanos / static_cast<double>(dataset.size())) << " ns/key)\n";
 
     benchOutput.push_back("construct_ms=" + std::to_string(double(nanos) / 1000.0 / 1000.0));
+    benchOutput.push_back("build_threads=" + std::to_string(buildThreads));
+    for (auto &field: buildStats.to_result_fields())
+        benchOutput.push_back(field);
     benchOutput.push_back("storage_bits=" + std::to_string(8.0 * lr.storage_bytes() / double(dataset.size())));
     benchOutput.push_back(
             "storage_factor=" + std::to_string(double((8.0 * lr.storage_bytes()) / lr.get_statistic_bits_input())));
 
     if constexpr (doQueries) {
+        if constexpr (requires { dataset.advise(MADV_RANDOM); })
+            dataset.advise(MADV_RANDOM);
         volatile uint64_t sum = 0;
 
         std::vector<uint32_t> queries(QUERIES);
@@ -82,35 +221,137 @@ benchmark(const DataSet &dataset, Model &model, std::vector<std::string> benchOu
             query = dist(gen);
         }
 
+        auto timeQueries = [&](auto &structure) {
+            timer.Start();
+            for (auto repeat = 0; repeat < REPEATS; ++repeat) {
+                for (auto i: queries) {
+                    auto example = dataset.get_example(i);
+                    uint64_t res = structure.query(i, example);
+                    sum += res;
+                }
+            }
+            return timer.ElapsedNanos(true);
+        };
+
         double nanosKey;
-        if (false) {
+        lsf::reset_query_profile();
+        nanos = timeQueries(lr);
+        nanosKey = nanos / static_cast<double>(TOT_QUERIES);
+        std::cout << "Total query time: " << nanos << " ns (" << nanosKey << " ns/query)\n";
+        benchOutput.push_back("query_nanos=" + std::to_string(nanosKey));
+        benchOutput.push_back("single_query_prefetch=" + std::to_string(!noSingleQueryPrefetch));
+        if constexpr (lsf::queryProfiling)
+            appendQueryProfile(lsf::collect_query_profile(), benchOutput);
+
+        if (hugePages != lsf::HugePageMode::NONE) {
+            // the same structure once more with its retrieval tables on huge pages, reloaded from an image of lr
+            // instead of being built again, the model is shared with lr
+            std::optional<lsf::LearnedStaticFunction<DataSet, Model, Storage>> hugeLr;
+            {
+                std::ostringstream os;
+                lr.save(os);
+                const std::string image = std::move(os).str();
+                hugeLr.emplace(std::as_bytes(std::span(image)), model, makeStorage<Storage>(hugePages));
+            }
+            // explicit pages fall back to transparent ones when the pool is empty, so the mode is read back
+            const std::string hugePagesUsed = lsf::huge_page_mode_in_use();
+            if (hugeLr->huge_page_bytes() == 0)
+                std::cout << "Warning: no retrieval table was allocated on huge pages\n";
+            auto hugeNanos = timeQueries(*hugeLr);
+            double hugeNanosKey = hugeNanos / static_cast<double>(TOT_QUERIES);
+            std::cout << "Total query time on " << hugePagesUsed << " huge pages (" << lsf::to_string(hugePages)
+                      << " requested): " << hugeNanos << " ns (" << hugeNanosKey << " ns/query)\n";
+            benchOutput.push_back("huge_pages=" + lsf::to_string(hugePages));
+            benchOutput.push_back("huge_pages_used=" + hugePagesUsed);
+            benchOutput.push_back("huge_page_table_bytes=" + std::to_string(hugeLr->huge_page_bytes()));
+            benchOutput.push_back("huge_page_query_nanos=" + std::to_string(hugeNanosKey));
+            benchOutput.push_back("huge_page_query_speedup=" + std::to_string(nanosKey / hugeNanosKey));
+        }
+
+        if (batchSize > 0) {
+            std::vector<uint64_t> keys(batchSize);
+            std::vector<float> features(batchSize * dataset.features_count());
+            std::vector<uint64_t> results(batchSize);
             timer.Start();
+            for (auto repeat = 0; repeat < REPEATS; ++repeat) {
+                for (size_t b = 0; b + batchSize <= queries.size(); b += batchSize) {
+                    for (size_t j = 0; j < batchSize; ++j) {
+                        keys[j] = queries[b + j];
+                        auto example = dataset.get_example(queries[b + j]);
+                        std::copy(example.begin(), example.end(), features.begin() + j * example.size());
+                    }
+                    lr.query_batch(keys, features, results);
+                    sum += results[0];
+                }
+            }
+            nanos = timer.ElapsedNanos(true);
+            nanosKey = nanos / static_cast<double>(REPEATS * (queries.size() / batchSize * batchSize));
+            std::cout << "Total batched query time: " << nanos << " ns (" << nanosKey << " ns/query)\n";
+            benchOutput.push_back("batch_size=" + std::to_string(batchSize));
+            benchOutput.push_back("prefetch_distance=" + std::to_string(prefetchDistance));
+            benchOutput.push_back("batch_query_nanos=" + std::to_string(nanosKey));
+        }
 
+        if (inFlightQueries > 0) {
+            lsf::InterleavedQueryExecutor executor(lr, inFlightQueries, [&](uint64_t, uint64_t value) {
+                sum += value;
+            });
+            timer.Start();
             for (auto repeat = 0; repeat < REPEATS; ++repeat) {
                 for (auto i: queries) {
-                    auto example = dataset.get_example(i);
-                    auto output = lr.query_probabilities(example);
-                    sum += output[0] + lr.query_storage(i, example).first;
+                    executor.submit(i, dataset.get_example(i), i);
                 }
             }
+            executor.drain();
             nanos = timer.ElapsedNanos(true);
             nanosKey = nanos / static_cast<double>(TOT_QUERIES);
-            std::cout << "Model inference and retrieval time " << nanos << " ns (" << (nanosKey) << " ns/query)\n";
-            benchOutput.push_back("inf_retrieval_nanos=" + std::to_string(nanosKey));
+            std::cout << "Total interleaved query time: " << nanos << " ns (" << nanosKey << " ns/query)\n";
+            benchOutput.push_back("in_flight_queries=" + std::to_string(inFlightQueries));
+            benchOutput.push_back("interleaved_query_nanos=" + std::to_string(nanosKey));
         }
 
-        timer.Start();
-        for (auto repeat = 0; repeat < REPEATS; ++repeat) {
-            for (auto i: queries) {
-                auto example = dataset.get_example(i);
-                uint64_t res = lr.query(i, example);
-                sum += res;
+        if (queryThreads > 0) {
+            benchmarkThreadSweep(queries, benchOutput, [&] {
+                return [&lr, &dataset, context = lr.make_query_context()](uint32_t i) mutable {
+                    return lr.query(i, dataset.get_example(i), context);
+                };
+            });
+        }
+
+        std::optional<lsf::NumaReplicatedLSF<std::remove_cvref_t<decltype(lr)>>> numaReplicas;
+        if (queryThreads > 0 && numaBench) {
+            /*
+             * The replica of node 0 stands for a single copy. It is queried from the cores of node 0 (local) and of
+             * node 1 (remote), and compared with threads on all nodes that each query their own node's replica.
+             */
+            try {
+                numaReplicas.emplace(lr, model);
+            } catch (std::exception &e) {
+                // e.g., out of memory on a node, the sweeps are skipped but the other results stay valid
+                std::cerr << "Skipping the NUMA benchmark, replicating the LSF failed: " << e.what() << std::endl;
+                benchOutput.push_back("numa_nodes=0");
             }
         }
-        nanos = timer.ElapsedNanos(true);
-        nanosKey = nanos / static_cast<double>(TOT_QUERIES);
-        std::cout << "Total query time: " << nanos << " ns (" << nanosKey << " ns/query)\n";
-        benchOutput.push_back("query_nanos=" + std::to_string(nanosKey));
+        if (queryThreads > 0 && numaBench && numaReplicas) {
+            const auto &replicas = *numaReplicas;
+            const auto &topology = replicas.topology();
+            auto queryReplica = [&](auto pickReplica) {
+                return [&, pickReplica] {
+                    const auto &replica = pickReplica();
+                    return [&replica, &dataset, context = replica.make_query_context()](uint32_t i) mutable {
+                        return replica.query(i, dataset.get_example(i), context);
+                    };
+                };
+            };
+            auto home = [&]() -> const auto & { return replicas.replica(0); };
+            benchOutput.push_back("numa_nodes=" + std::to_string(topology.nodes()));
+            benchmarkThreadSweep(queries, benchOutput, queryReplica(home), topology.cpus(0), "numa_local_");
+            if (topology.nodes() > 1)
+                benchmarkThreadSweep(queries, benchOutput, queryReplica(home), topology.cpus(1), "numa_remote_");
+            benchmarkThreadSweep(queries, benchOutput, queryReplica([&]() -> const auto & {
+                return replicas.local();
+            }), topology.interleaved_cpus(), "numa_replicated_");
+        }
     } else {
         benchOutput.push_back("query_nanos=999999");
         benchOutput.push_back("inf_retrieval_nanos=999999");
@@ -124,6 +365,50 @@ benchmark(const DataSet &dataset, Model &model, std::vector<std::string> benchOu
         assert(found);
         ok &= found;
     }
+    if (!persistPath.empty()) {
+        timer.Start();
+        lr.save(persistPath);
+        nanos = timer.ElapsedNanos(true);
+        lsf::MappedFile file(persistPath);
+        // the reloaded structure runs on the model embedded in the mapping, its retrievals are copied out of it
+        std::optional<Model> mappedModel;
+        if constexpr (std::is_constructible_v<Model, std::span<const std::byte>>) {
+            if (auto flatbuffer = lsf::embedded_model(file.bytes()); !flatbuffer.empty()) {
+                mappedModel.emplace(flatbuffer);
+                // TFLite reads the weights from the flatbuffer, the native engine copies them when it is created
+                if (hugePages != lsf::HugePageMode::NONE && std::is_same_v<Model, lsf::ModelWrapper>)
+                    lsf::advise_huge_pages(flatbuffer);
+            }
+        }
+        lsf::LearnedStaticFunction<DataSet, Model, Storage> loaded(file, mappedModel ? *mappedModel : model,
+                                                                   makeStorage<Storage>(hugePages));
+        auto loadNanos = timer.ElapsedNanos(true);
+        std::cout << "Save time: " << nanos << " ns, load time: " << loadNanos << " ns\n";
+        benchOutput.push_back("save_ms=" + std::to_string(double(nanos) / 1000.0 / 1000.0));
+        benchOutput.push_back("load_ms=" + std::to_string(double(loadNanos) / 1000.0 / 1000.0));
+        benchOutput.push_back("file_bits=" + std::to_string(8.0 * file.size() / double(dataset.size())));
+        for (size_t i = 0; i < dataset.size(); ++i) {
+            bool found = loaded.query(i, dataset.get_example(i)) == dataset.get_label(i);
+            assert(found);
+            ok &= found;
+        }
+    }
+    if (batchSize > 0) {
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> results(batchSize);
+        for (size_t b = 0; b < dataset.size(); b += batchSize) {
+            size_t count = std::min(batchSize, dataset.size() - b);
+            keys.resize(count);
+            std::iota(keys.begin(), keys.end(), b);
+            auto first = dataset.get_example(b);
+            lr.query_batch(keys, {first.data(), count * first.size()}, results);
+            for (size_t j = 0; j < count; ++j) {
+                bool found = results[j] == dataset.get_label(b + j);
+                assert(found);
+                ok &= found;
+            }
+        }
+    }
     if (!ok) {
         std::cerr << "FAILED\n";
         exit(EXIT_FAILURE); // prevent incorrect outputs
@@ -183,6 +468,12 @@ void benchmarkBuRR(const Dataset &dataset, std::vector<std::string> benchOutput)
     std::cout << "Total query time: " << nanos << " ns (" << nanosKey << " ns/query)\n";
     benchOutput.push_back("query_nanos=" + std::to_string(nanosKey));
 
+    if (queryThreads > 0) {
+        benchmarkThreadSweep(queries, benchOutput, [&] {
+            return [&retrievalDs](uint32_t i) { return uint64_t(retrievalDs.QueryRetrieval(i)); };
+        });
+    }
+
     bool ok = true;
     for (size_t i = 0; i < dataset.size(); ++i) {
         auto label = dataset.get_label(i);
@@ -289,6 +580,25 @@ void dispatchStorage(const DataSet &dataset, Model &model,
                     model,
                     benchOutput);
         }
+        // the storages below are not part of all, which stays the storage set of the paper, and run only by name
+        if (storageInput == "fixed_filter_fano50") {
+            benchmark<DataSet, lsf::FilteredLSFStorage<lsf::BitWiseFilterCoding<FilteredFano50>, lsf::FixedWidthFilterBackend>, Model, true>(
+                    dataset,
+                    model,
+                    benchOutput);
+        }
+        if (storageInput == "colocated_filter_fano50") {
+            benchmark<DataSet, lsf::CoLocatedLSFStorage<lsf::BitWiseFilterCoding<FilteredFano50>>, Model, true>(
+                    dataset,
+                    model,
+                    benchOutput);
+        }
+        if (storageInput == "partitioned_filter_fano50") {
+            benchmark<DataSet, lsf::PartitionedLSFStorage<lsf::FilteredLSFStorage<lsf::BitWiseFilterCoding<FilteredFano50>>>, Model, true>(
+                    dataset,
+                    model,
+                    benchOutput);
+        }
     } else {
         printResult(benchOutput);
     }
@@ -307,7 +617,6 @@ void dispatchAllModelsRecurse(const std::string &datasetName, const DataSet &dat
             if (fileName.starts_with(datasetName) and fileName.ends_with(".tflite") and
                 (modelInput == ALL or fileName.contains(modelInput))) {
                 try {
-                    lsf::ModelWrapper model(p);
                     auto evalFile = p.string() + "_eval.txt";
                     std::ifstream evalStream;
                     evalStream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -319,7 +628,16 @@ void dispatchAllModelsRecurse(const std::string &datasetName, const DataSet &dat
                     std::vector benchOutputCopy = benchOutput;
                     while (iss >> token)
                         benchOutputCopy.push_back(token);
-                    dispatchStorage<DataSet, lsf::ModelWrapper>(dataset, model, benchOutputCopy, fileName, modelBench);
+                    if (nativeModels) {
+                        lsf::ModelNativeMLP model(p);
+                        benchOutputCopy.emplace_back("engine=native");
+                        dispatchStorage<DataSet, lsf::ModelNativeMLP>(dataset, model, benchOutputCopy, fileName,
+                                                                      modelBench);
+                    } else {
+                        lsf::ModelWrapper model(p);
+                        benchOutputCopy.emplace_back("engine=tflite");
+                        dispatchStorage<DataSet, lsf::ModelWrapper>(dataset, model, benchOutputCopy, fileName, modelBench);
+                    }
                 } catch (std::runtime_error &e) {
                     std::cerr << "Skipping model " << fileName << " because of " << e.what() << std::endl;
                 }
@@ -474,13 +792,38 @@ int main(int argc, char *argv[]) {
                    "Includes all models that have the substring in their filename or all");
     cmd.add_string('e', "modelEval", evalModelInput,
                    "Models for which the datastructures are actually constructed");
-    cmd.add_string('s', "storage", storageInput, "Name of dataset or all");
+    cmd.add_string('s', "storage", storageInput,
+                   "Name of storage or all, which excludes fixed_filter_fano50, colocated_filter_fano50 and "
+                   "partitioned_filter_fano50");
     cmd.add_string('c', "competitor", competitorInput, "Name of competitor or all");
+    cmd.add_size_t('b', "batchSize", batchSize, "Number of keys per batched query, 0 disables batched queries");
+    cmd.add_size_t('t', "buildThreads", buildThreads, "Number of threads used to construct the LSF storages");
+    cmd.add_flag('n', "nativeModels", nativeModels,
+                 "Run the .tflite models with the native MLP engine instead of the TFLite interpreter");
+    cmd.add_size_t('q', "queryThreads", queryThreads,
+                   "Maximum number of pinned query threads in the throughput sweep, 0 disables the sweep");
+    cmd.add_size_t('k', "shardKeys", shardKeys, "Keys per shard of the partitioned storages");
+    cmd.add_size_t('M', "shardBudgetMB", shardBudgetMB,
+                   "Memory budget in MiB for the shards of a partitioned storage that are built concurrently");
+    cmd.add_size_t('D', "prefetchDistance", prefetchDistance,
+                   "Keys a batched query prefetches ahead, 0 disables prefetching in batched queries");
+    cmd.add_flag('P', "noSingleQueryPrefetch", noSingleQueryPrefetch,
+                 "Do not request the filter row of a single query before its inference");
+    cmd.add_size_t('I', "inFlightQueries", inFlightQueries,
+                   "Queries interleaved as coroutines by the single-thread executor, 0 disables it");
+    cmd.add_flag('S', "streamingBuild", streamingBuild,
+                 "Construct from a single sequential pass over the keys where the storage supports it");
+    cmd.add_flag('N', "numaBench", numaBench,
+                 "With queryThreads, also compare local, remote and per-node replicated LSFs on NUMA machines");
+    cmd.add_string('H', "hugePages", hugePagesInput,
+                   "Also query a copy of each LSF with its retrieval tables on huge pages: none, thp, 2mb or 1gb");
+    cmd.add_string('p', "persistPath", persistPath, "File to save each LSF to and reload it from, or empty to skip");
 
     if (!cmd.process(argc, argv)) {
         cmd.print_usage();
         return EXIT_FAILURE;
     }
+    hugePages = lsf::parse_huge_page_mode(hugePagesInput);
 
     std::vector<std::string> benchOutput;
     dispatchDataSet(benchOutput);